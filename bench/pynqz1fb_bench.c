@@ -0,0 +1,456 @@
+/**
+ * @file pynqz1fb_bench.c
+ * @author Kenta IDA <fuga@fugafuga.org>
+ * @description
+ * Host benchmark for the pixel conversion kernels in pynqz1fb_blit.h.
+ * Runs each kernel over a full frame at every resolution the driver supports,
+ * and checks the result against a straightforward per-pixel implementation.
+ * Note that the destination is cached memory on the host, unlike the scanout frame on the board.
+ */
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#include "../pynqz1fb_blit.h"
+
+// Resolutions in pynqz1_fb_screen_params.
+static const u32 resolutions[][2] = {
+    { 640,  480  },
+    { 800,  480  },
+    { 800,  600  },
+    { 1280, 720  },
+    { 1280, 1024 },
+    { 1920, 1080 },
+};
+
+// Minimum time to run each kernel in seconds.
+#define BENCH_MIN_SECONDS 0.5
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/**
+ * Fill rects with the damaged rectangles {x, y, width, height} checked on a surface in addition to the full frame.
+ * They have odd offsets and sizes which are not multiples of PYNQZ1_BLIT_TILE, and some of them touch the right and bottom edges.
+ * Returns the number of rectangles.
+ */
+static u32 make_check_rects(u32 width, u32 height, u32 rects[][4])
+{
+    const u32 list[][4] = {
+        { 1,           3,            33,         17          },
+        { 17,          9,            95,         71          },
+        { 31,          33,           width - 38, height - 38 },
+        { width - 45,  height - 29,  45,         29          },
+        { width - 33,  height - 33,  33,         33          },
+        { 5,           height - 1,   width - 5,  1           },
+        { width - 1,   0,            1,          height      },
+    };
+    u32 i;
+    for(i = 0; i < sizeof(list)/sizeof(list[0]); i++) {
+        memcpy(rects[i], list[i], sizeof(list[i]));
+    }
+    return i;
+}
+
+// Upper bound of the number of rectangles make_check_rects returns.
+#define MAX_CHECK_RECTS 8
+
+/**
+ * Kernel which converts a rectangle {x, y, w, h} of a width x height source.
+ * param is the rotation or the magnification factor.
+ */
+typedef void (*rect_func)(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u32 width, u32 height, u32 param,
+                          u32 x, u32 y, u32 w, u32 h);
+
+/**
+ * Run a kernel over rectangles of the source and compare the whole destination with the reference,
+ * so that pixels outside the rectangles must not be written either.
+ */
+static int check_rects(rect_func kernel, rect_func reference, const char* name, u8* dst, u8* ref, u32 dst_stride, u32 size,
+                       const u8* src, u32 src_stride, u32 width, u32 height, u32 param)
+{
+    u32 rects[MAX_CHECK_RECTS][4];
+    u32 count = make_check_rects(width, height, rects);
+    u32 i;
+    int failed = 0;
+
+    for(i = 0; i < count; i++) {
+        const u32* r = rects[i];
+        memset(dst, 0x5a, size);
+        memset(ref, 0x5a, size);
+        kernel(dst, dst_stride, src, src_stride, width, height, param, r[0], r[1], r[2], r[3]);
+        reference(ref, dst_stride, src, src_stride, width, height, param, r[0], r[1], r[2], r[3]);
+        if( memcmp(dst, ref, size) != 0 ) {
+            fprintf(stderr, "Mismatch at %ux%u %s %u rect (%u, %u, %u, %u)\n", width, height, name, param, r[0], r[1], r[2], r[3]);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+/**
+ * Run a kernel over the whole source repeatedly and return the average time per frame in milliseconds.
+ */
+static double bench_kernel(rect_func func, u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u32 width, u32 height, u32 param)
+{
+    double start = now();
+    double elapsed;
+    u32 frames = 0;
+    do {
+        func(dst, dst_stride, src, src_stride, width, height, param, 0, 0, width, height);
+        frames++;
+        elapsed = now() - start;
+    } while(elapsed < BENCH_MIN_SECONDS);
+    return elapsed*1000.0/frames;
+}
+
+/**
+ * Fill a buffer with a pattern which does not repeat within a line.
+ */
+static void fill_pattern(u8* buffer, u32 size)
+{
+    u32 i;
+    for(i = 0; i < size; i++) {
+        buffer[i] = (u8)(i*131 + (i >> 11));
+    }
+}
+
+/**
+ * Straightforward per-pixel rotation of a rectangle of the source to compare with and to verify the tiled kernels.
+ */
+static void reference_rotate(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u32 width, u32 height, u32 rotate,
+                             u32 rx, u32 ry, u32 rw, u32 rh)
+{
+    u32 x, y;
+    for(y = ry; y < ry + rh; y++) {
+        for(x = rx; x < rx + rw; x++) {
+            u32 dx, dy;
+            switch(rotate) {
+            case 90:  dx = height - 1 - y; dy = x; break;
+            case 180: dx = width - 1 - x;  dy = height - 1 - y; break;
+            case 270: dx = y;              dy = width - 1 - x; break;
+            default:  dx = x;              dy = y; break;
+            }
+            memcpy(dst + dy*dst_stride + dx*PYNQZ1_BLIT_BPP, src + y*src_stride + x*PYNQZ1_BLIT_BPP, PYNQZ1_BLIT_BPP);
+        }
+    }
+}
+
+static u8 rotate_work[PYNQZ1_BLIT_ROTATE_WORK_SIZE];
+
+static void tiled_rotate(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u32 width, u32 height, u32 rotate,
+                         u32 x, u32 y, u32 w, u32 h)
+{
+    pynqz1_blit_rotate(dst, dst_stride, src, src_stride, width, height, rotate, rotate_work, x, y, w, h);
+}
+
+/**
+ * Straightforward per-pixel magnification of a rectangle of the source to compare with and to verify pynqz1_blit_upscale.
+ */
+static void reference_upscale(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u32 width, u32 height, u32 scale,
+                              u32 rx, u32 ry, u32 rw, u32 rh)
+{
+    u32 x, y;
+    for(y = ry*scale; y < (ry + rh)*scale; y++) {
+        for(x = rx*scale; x < (rx + rw)*scale; x++) {
+            memcpy(dst + y*dst_stride + x*PYNQZ1_BLIT_BPP, src + (y/scale)*src_stride + (x/scale)*PYNQZ1_BLIT_BPP, PYNQZ1_BLIT_BPP);
+        }
+    }
+}
+
+static u8* upscale_line;
+
+static void line_upscale(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u32 width, u32 height, u32 scale,
+                         u32 x, u32 y, u32 w, u32 h)
+{
+    pynqz1_blit_upscale(dst, dst_stride, src, src_stride, scale, upscale_line, x, y, w, h);
+}
+
+/**
+ * Benchmark magnification of a surface of 1/scale size of each output mode.
+ */
+static int bench_upscale(void)
+{
+    static const u32 scales[] = { 2, 3 };
+    size_t r, k;
+    int failed = 0;
+
+    printf("%-10s %-6s %12s %12s %10s\n", "mode", "scale", "line[ms]", "naive[ms]", "out[MB/s]");
+    for(r = 0; r < sizeof(resolutions)/sizeof(resolutions[0]); r++) {
+        u32 out_width  = resolutions[r][0];
+        u32 out_height = resolutions[r][1];
+        u32 dst_stride = out_width*PYNQZ1_BLIT_BPP;
+        u32 size       = dst_stride*out_height;
+        u8* src        = malloc(size);
+        u8* dst        = calloc(1, size);
+        u8* ref        = calloc(1, size);
+
+        upscale_line = malloc(dst_stride);
+        if( !src || !dst || !ref || !upscale_line ) {
+            fprintf(stderr, "Failed to allocate buffers\n");
+            return 1;
+        }
+        fill_pattern(src, size);
+
+        for(k = 0; k < sizeof(scales)/sizeof(scales[0]); k++) {
+            u32 scale = scales[k];
+            u32 width = out_width/scale;
+            u32 height = out_height/scale;
+            u32 src_stride = width*PYNQZ1_BLIT_BPP;
+            double line, naive;
+
+            line  = bench_kernel(line_upscale, dst, dst_stride, src, src_stride, width, height, scale);
+            naive = bench_kernel(reference_upscale, ref, dst_stride, src, src_stride, width, height, scale);
+            if( memcmp(dst, ref, size) != 0 ) {
+                fprintf(stderr, "Mismatch at %ux%u scale %u\n", out_width, out_height, scale);
+                failed = 1;
+            }
+            failed |= check_rects(line_upscale, reference_upscale, "scale", dst, ref, dst_stride, size, src, src_stride, width, height, scale);
+            printf("%4ux%-5u %-6u %12.3f %12.3f %10.1f\n", out_width, out_height, scale, line, naive,
+                   width*scale*height*scale*PYNQZ1_BLIT_BPP/line/1000.0);
+        }
+        free(src);
+        free(dst);
+        free(ref);
+        free(upscale_line);
+    }
+    return failed;
+}
+
+static u32 expand8_lut[256];
+static u8* expand8_line;
+
+/**
+ * Straightforward per-pixel expansion of a rectangle to compare with and to verify pynqz1_blit_expand8.
+ */
+static void reference_expand8(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u32 width, u32 height, u32 param,
+                              u32 rx, u32 ry, u32 rw, u32 rh)
+{
+    u32 x, y;
+    for(y = ry; y < ry + rh; y++) {
+        for(x = rx; x < rx + rw; x++) {
+            u32 p = expand8_lut[src[y*src_stride + x]];
+            u8* d = dst + y*dst_stride + x*PYNQZ1_BLIT_BPP;
+            d[0] = (u8)p;
+            d[1] = (u8)(p >> 8);
+            d[2] = (u8)(p >> 16);
+        }
+    }
+}
+
+static void lut_expand8(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u32 width, u32 height, u32 param,
+                        u32 x, u32 y, u32 w, u32 h)
+{
+    pynqz1_blit_expand8(dst, dst_stride, src, src_stride, expand8_lut, expand8_line, x, y, w, h);
+}
+
+/**
+ * Benchmark expansion of an 8bpp surface of each output mode through a 256 entry palette.
+ */
+static int bench_expand8(void)
+{
+    size_t r;
+    u32 i;
+    int failed = 0;
+
+    for(i = 0; i < 256; i++) {
+        expand8_lut[i] = (i*2654435761u) & 0xffffffu;
+    }
+    printf("%-10s %12s %12s %10s\n", "mode", "lut[ms]", "naive[ms]", "out[MB/s]");
+    for(r = 0; r < sizeof(resolutions)/sizeof(resolutions[0]); r++) {
+        u32 width      = resolutions[r][0];
+        u32 height     = resolutions[r][1];
+        u32 dst_stride = width*PYNQZ1_BLIT_BPP;
+        u32 size       = dst_stride*height;
+        u8* src        = malloc(width*height);
+        u8* dst        = malloc(size);
+        u8* ref        = malloc(size);
+        double lut, naive;
+
+        expand8_line = malloc(dst_stride);
+        if( !src || !dst || !ref || !expand8_line ) {
+            fprintf(stderr, "Failed to allocate buffers\n");
+            return 1;
+        }
+        fill_pattern(src, width*height);
+
+        lut   = bench_kernel(lut_expand8, dst, dst_stride, src, width, width, height, 8);
+        naive = bench_kernel(reference_expand8, ref, dst_stride, src, width, width, height, 8);
+        if( memcmp(dst, ref, size) != 0 ) {
+            fprintf(stderr, "Mismatch at %ux%u 8bpp\n", width, height);
+            failed = 1;
+        }
+        failed |= check_rects(lut_expand8, reference_expand8, "bpp", dst, ref, dst_stride, size, src, width, width, height, 8);
+        printf("%4ux%-5u %12.3f %12.3f %10.1f\n", width, height, lut, naive, size/lut/1000.0);
+        free(src);
+        free(dst);
+        free(ref);
+        free(expand8_line);
+    }
+    return failed;
+}
+
+/**
+ * Check pynqz1_blit_div255 against rounded division for every product of two 8bit values,
+ * and pynqz1_blit_blend against a floating point reference.
+ * Transparent pixels must leave the destination untouched and opaque pixels must be copied exactly.
+ */
+static int check_blend(void)
+{
+    static const u32 alphas[] = { 0, 1, 128, 254, 255 };
+    enum { WIDTH = 256, HEIGHT = 5 };
+    u32 src[WIDTH*HEIGHT];
+    u8 dst[WIDTH*HEIGHT*PYNQZ1_BLIT_BPP];
+    u8 background[WIDTH*HEIGHT*PYNQZ1_BLIT_BPP];
+    u32 value, i, k;
+    int failed = 0;
+
+    for(value = 0; value <= 255*255; value++) {
+        if( pynqz1_blit_div255(value) != (u32)(value/255.0 + 0.5) ) {
+            fprintf(stderr, "Mismatch at div255(%u)\n", value);
+            failed = 1;
+        }
+    }
+
+    // Each line has every pixel alpha, with the color channels varying independently of it.
+    for(i = 0; i < WIDTH*HEIGHT; i++) {
+        src[i] = (u32)(i % WIDTH) << 24 | ((i*2654435761u) & 0xffffffu);
+    }
+    fill_pattern(background, sizeof(background));
+    for(k = 0; k < sizeof(alphas)/sizeof(alphas[0]); k++) {
+        u32 alpha = alphas[k];
+
+        memcpy(dst, background, sizeof(dst));
+        pynqz1_blit_blend(dst, WIDTH*PYNQZ1_BLIT_BPP, (const u8*)src, WIDTH*4, alpha, WIDTH, HEIGHT);
+        for(i = 0; i < WIDTH*HEIGHT; i++) {
+            double a = (u32)((src[i] >> 24)*alpha/255.0 + 0.5);
+            u32 c;
+            for(c = 0; c < PYNQZ1_BLIT_BPP; c++) {
+                u32 s = (src[i] >> (c*8)) & 0xffu;
+                u32 d = background[i*PYNQZ1_BLIT_BPP + c];
+                u32 expected = (u32)((s*a + d*(255 - a))/255.0 + 0.5);
+                if( a == 0 ) expected = d;
+                if( a == 255 ) expected = s;
+                if( dst[i*PYNQZ1_BLIT_BPP + c] != expected ) {
+                    fprintf(stderr, "Mismatch at blend alpha %u pixel %08x over %u: %u, expected %u\n",
+                            alpha, src[i], d, dst[i*PYNQZ1_BLIT_BPP + c], expected);
+                    failed = 1;
+                }
+            }
+        }
+    }
+    return failed;
+}
+
+/**
+ * Check that changing any single byte of a tile changes pynqz1_blit_hash,
+ * and that hashing a tile line by line gives the same hash as hashing it at once.
+ */
+static int check_hash(void)
+{
+    enum { TILE = 64, STRIDE = (TILE + 3)*PYNQZ1_BLIT_BPP };
+    static u8 frame[STRIDE*TILE];
+    u32 length = TILE*PYNQZ1_BLIT_BPP;
+    u32 hash, lines, row, x, y;
+    int failed = 0;
+
+    fill_pattern(frame, sizeof(frame));
+    hash = pynqz1_blit_hash(PYNQZ1_BLIT_HASH_INIT, frame, STRIDE, length, TILE);
+    lines = PYNQZ1_BLIT_HASH_INIT;
+    for(row = 0; row < TILE; row++) {
+        lines = pynqz1_blit_hash(lines, frame + row*STRIDE, 0, length, 1);
+    }
+    if( lines != hash ) {
+        fprintf(stderr, "Mismatch at hash line by line\n");
+        failed = 1;
+    }
+    for(y = 0; y < TILE; y++) {
+        for(x = 0; x < length; x++) {
+            u8* p = frame + y*STRIDE + x;
+            *p ^= 0x01;
+            if( pynqz1_blit_hash(PYNQZ1_BLIT_HASH_INIT, frame, STRIDE, length, TILE) == hash ) {
+                fprintf(stderr, "Hash unchanged by byte %u of line %u\n", x, y);
+                failed = 1;
+            }
+            *p ^= 0x01;
+        }
+    }
+    // Bytes outside the tile must not affect the hash.
+    frame[length] ^= 0xff;
+    if( pynqz1_blit_hash(PYNQZ1_BLIT_HASH_INIT, frame, STRIDE, length, TILE) != hash ) {
+        fprintf(stderr, "Hash changed by a byte outside the tile\n");
+        failed = 1;
+    }
+    return failed;
+}
+
+int main(void)
+{
+    static const u32 rotations[] = { 0, 90, 180, 270 };
+    size_t r;
+    int failed = 0;
+
+    printf("%-10s %-6s %12s %12s %10s\n", "mode", "rotate", "tiled[ms]", "naive[ms]", "tiled[MB/s]");
+    for(r = 0; r < sizeof(resolutions)/sizeof(resolutions[0]); r++) {
+        u32 width  = resolutions[r][0];
+        u32 height = resolutions[r][1];
+        u32 size   = width*height*PYNQZ1_BLIT_BPP;
+        u8* src    = malloc(size);
+        u8* dst    = malloc(size);
+        u8* ref    = malloc(size);
+        size_t k;
+
+        if( !src || !dst || !ref ) {
+            fprintf(stderr, "Failed to allocate buffers\n");
+            return 1;
+        }
+        fill_pattern(src, size);
+
+        for(k = 0; k < sizeof(rotations)/sizeof(rotations[0]); k++) {
+            u32 rotate = rotations[k];
+            u32 dst_stride = (rotate == 90 || rotate == 270 ? height : width)*PYNQZ1_BLIT_BPP;
+            u32 src_stride = width*PYNQZ1_BLIT_BPP;
+            double tiled, naive;
+
+            tiled = bench_kernel(tiled_rotate, dst, dst_stride, src, src_stride, width, height, rotate);
+            naive = bench_kernel(reference_rotate, ref, dst_stride, src, src_stride, width, height, rotate);
+            if( memcmp(dst, ref, size) != 0 ) {
+                fprintf(stderr, "Mismatch at %ux%u rotate %u\n", width, height, rotate);
+                failed = 1;
+            }
+            failed |= check_rects(tiled_rotate, reference_rotate, "rotate", dst, ref, dst_stride, size, src, src_stride, width, height, rotate);
+            printf("%4ux%-5u %-6u %12.3f %12.3f %10.1f\n", width, height, rotate, tiled, naive, size/tiled/1000.0);
+        }
+        free(src);
+        free(dst);
+        free(ref);
+    }
+    printf("\n");
+    failed |= bench_upscale();
+    printf("\n");
+    failed |= bench_expand8();
+    failed |= check_blend();
+    failed |= check_hash();
+    return failed;
+}
@@ -32,8 +32,22 @@
 #include <linux/io.h>
 #include <linux/slab.h>
 #include <linux/delay.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/uaccess.h>
+#include <linux/pagemap.h>
+#include <linux/rmap.h>
+#include <linux/bitmap.h>
+#include <linux/interrupt.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 
 #include "pynqz1fb.h"
+#include "pynqz1fb_ioctl.h"
+#include "pynqz1fb_blit.h"
 
 #define BIT_DISPLAY_RED 16
 #define BIT_DISPLAY_BLUE 0
@@ -85,10 +99,40 @@ static struct fb_var_screeninfo pynqz1_fb_var = {
 struct pynqz1_frame {
     u32     phys;
     void*   virt;
+    u32     readers;    // Number of readers copying from the frame. The frame is not released while it is non-zero. Protected by frame_lock.
 };
 
-#define FB_NUMBER_OF_FRAMES 1
+#define FB_MAX_NUMBER_OF_FRAMES 4
+// Calculate page aligned framebuffer size.
+#define GET_FB_SIZE(fbdev) PAGE_ALIGN((fbdev)->width * (fbdev)->height * BYTES_PER_PIXEL)
 #define PALETTE_ENTRIES_NO 16
+// Number of colors of the palettized (8bpp) drawing surface.
+#define PALETTE_8BPP_ENTRIES 256
+
+// Time for which the display must be blanked before unused back buffers are released.
+#define FRAME_RELEASE_DELAY_MS 60000
+
+// Maximum time to wait for the flip of the double buffered shadow surface.
+#define FLIP_TIMEOUT_MS 100
+
+// Maximum width and height of the cursor in pixels.
+#define CURSOR_MAX_SIZE 32
+// Maximum bytes per pixel of a surface on which the cursor is drawn.
+#define CURSOR_MAX_BYTES_PER_PIXEL 4
+
+// Number of entries in the presentation queue.
+#define PRESENT_QUEUE_DEPTH 8
+
+// Delay between the first modification of the shadow surface and writing it to the scanout frame.
+#define SHADOW_FLUSH_DELAY_MS 20
+
+// Edge length in pixels of the tiles into which the scanout frame is split for the readback interface.
+#define READBACK_TILE_SIZE 64
+
+// Maximum number of overlay framebuffer devices.
+#define MAX_OVERLAYS 4
+// Overlays have A8R8G8B8 pixels.
+#define OVERLAY_BYTES_PER_PIXEL 4
 
 
 struct dynclk_param
@@ -125,6 +169,63 @@ struct pynqz1_fb_screen_param pynqz1_fb_screen_params[] = {
     { 0 },
 };
 
+/**
+ * Damaged region of a surface. The region is empty if x1 >= x2.
+ */
+struct pynqz1_fb_damage {
+    u32 x1, y1; // Top left corner (inclusive)
+    u32 x2, y2; // Bottom right corner (exclusive)
+};
+
+/**
+ * Entry of the presentation queue.
+ */
+struct pynqz1_fb_present_entry {
+    u32 buffer;     // Index of the frame to show.
+    u32 flags;      // PYNQZ1_FB_PRESENT_XXX flags.
+    u64 target;     // Vertical blanking count or time in nanoseconds.
+    u64 sequence;   // Sequence number.
+};
+
+/**
+ * State of the software cursor drawn with save-under.
+ * Only the pixels under the cursor mask are saved and drawn, in raster order of the cursor rectangle.
+ */
+struct pynqz1_fb_cursor {
+    u32 shown;                  // Non-zero if the cursor is drawn on the screen.
+    u32 x, y;                   // Top left corner of the cursor rectangle. (clipped to the screen)
+    u32 width, height;          // Size of the cursor rectangle. (clipped to the screen)
+    u32 pitch;                  // Bytes per line of mask.
+    u8  mask[CURSOR_MAX_SIZE*CURSOR_MAX_SIZE/8];                            // Cursor mask. 1bpp, MSB first.
+    u8  saved[CURSOR_MAX_SIZE*CURSOR_MAX_SIZE*CURSOR_MAX_BYTES_PER_PIXEL];  // Pixels under the mask before the cursor was drawn.
+    u8  drawn[CURSOR_MAX_SIZE*CURSOR_MAX_SIZE*CURSOR_MAX_BYTES_PER_PIXEL];  // Pixels under the mask as the cursor was drawn.
+};
+
+struct pynqz1_fb_device;
+
+/**
+ * Cached drawing surface of a framebuffer device.
+ * The primary framebuffer device and each overlay have one.
+ */
+struct pynqz1_fb_layer {
+    struct fb_info*             info;   // Framebuffer device which draws into this layer.
+    struct pynqz1_fb_device*    fbdev;  // Device which writes this layer to the scanout frame.
+
+    void*           shadow;         // Cached drawing surface.
+    u32             shadow_size;    // Size of the shadow surface in bytes.
+    unsigned long*  dirty_pages;    // Bitmap of shadow surface pages modified through user mappings.
+
+    // Placement on the primary surface. The primary layer is always at (0, 0) and below all overlays.
+    s32 x;
+    s32 y;
+    u32 zorder;     // Overlays with larger zorder are drawn above.
+    u32 alpha;      // Global alpha (0-255) which is multiplied with per-pixel alpha.
+    u32 visible;    // Non-zero if the overlay is not blanked.
+    u32 registered; // Non-zero if the overlay framebuffer device is registered.
+
+    u32 pseudo_palette[PALETTE_ENTRIES_NO]; // Pseudo palette table of an overlay.
+};
+
 // Number of memory resources this driver requires.
 #define NUMBER_OF_MEM_RESOURCES 3
 
@@ -136,7 +237,13 @@ struct pynqz1_fb_device {
     void __iomem*   reg_vdma;   // virtual address to which VDMA register space is mapped.
 
     struct device*  dev;        // device object
-    struct pynqz1_frame frame[FB_NUMBER_OF_FRAMES]; // Frame information.
+    struct pynqz1_frame frame[FB_MAX_NUMBER_OF_FRAMES]; // Frame information.
+    u32    number_of_frames;                            // Number of frames used. Frames other than frame 0 are allocated on first use.
+    struct mutex frame_lock;                            // Protects frame[].virt, frame_mapped and cma_usage.
+    u32    frame_mapped;                                // Number of user mappings of the frames.
+    u32    cma_usage;                                   // Bytes of frames currently allocated.
+    u32    cma_peak;                                    // Maximum of cma_usage.
+    struct delayed_work release_work;                   // Work to release back buffers while the display is blanked.
     u32    pseudo_palette[PALETTE_ENTRIES_NO];      // Pseudo palette table.
 
     u32 width;  // Number of horizontal pixels .
@@ -148,8 +255,51 @@ struct pynqz1_fb_device {
     u32 flags;  // Flags. refer to PYNQZ1_FB_FLAGS_XXX constants.
 
     struct pynqz1_fb_screen_param* screen_param;    // Screen parameters
+    u32 bandwidth_budget;   // Memory bandwidth the scanout may consume in kB/s. 0 if unlimited.
+
+    struct pynqz1_fb_cursor cursor; // Software cursor on the primary framebuffer device.
+
+    u32 bits_per_pixel;                     // Bits per pixel of the drawing surface. (24, or 8 with the palette)
+    u32 palette[PALETTE_8BPP_ENTRIES];      // Colors (0x00RRGGBB) of the 8bpp drawing surface.
+
+    u32 rotate; // Clockwise rotation of the drawing surface on the screen in degrees. (0, 90, 180 or 270)
+    u32 scale;  // Magnification factor from the drawing surface to the screen. (1, 2 or 3)
+
+    struct pynqz1_fb_layer  primary;    // Shadow surface of this device. Used if PYNQZ1_FB_FLAGS_SHADOW is set.
+    struct pynqz1_fb_layer* overlays[MAX_OVERLAYS]; // Overlay framebuffer devices.
+    u32             number_of_overlays;
+    void*           compose;        // Surface into which the primary surface and overlays are composed. NULL without overlays.
+    u8*             line_buffer;    // Work buffer which holds a scanout line, or a tile of the rotation kernels. Protected by flush_lock.
+
+    u32             readback_columns;   // Number of readback tiles in a row of the scanout frame.
+    u32             readback_rows;      // Number of rows of readback tiles.
+    unsigned long*  readback_dirty;     // Bitmap of readback tiles changed since they were last read. Protected by flush_lock.
+    u32*            readback_hashes;    // Hash of each readback tile when it was last checked. Used without the shadow surface.
+    u32             readback_reported;  // Non-zero if damage was reported by PYNQZ1_FB_IOCTL_DAMAGE without the shadow surface since the last read. Protected by flush_lock.
+
+    int             irq;            // VTC interrupt. 0 if not available.
+    unsigned long   pending;        // Pending requests for the VTC interrupt handler. refer to PYNQZ1_FB_PENDING_XXX constants.
+    wait_queue_head_t vblank_wait;  // Woken up at every vertical blanking.
+    u64             vblank_period;  // Measured interval of vertical blankings in nanoseconds.
+
+    spinlock_t      present_lock;   // Protects the presentation queue and present_status.
+    struct pynqz1_fb_present_entry present_queue[PRESENT_QUEUE_DEPTH];  // Ring buffer of queued entries.
+    u32             present_head;   // Index of the oldest entry in present_queue.
+    u64             present_sequence;   // Sequence number of the next entry.
+    struct pynqz1_fb_present_status present_status; // Mode, statistics and the frame being shown.
+
+    spinlock_t      damage_lock;    // Protects damage.
+    struct pynqz1_fb_damage damage; // Region of the shadow surface not yet written to the scanout frame.
+    struct mutex    flush_lock;     // Serializes writing to the scanout frame.
+    struct delayed_work flush_work; // Work to write the damaged region to the scanout frame.
+    u32             shadow_frame;   // Frame into which the shadow surface was written last. Protected by flush_lock.
+    struct pynqz1_fb_damage flip_damage;    // Region written into shadow_frame last, which the other frame lacks. Protected by flush_lock.
 };
 #define PYNQZ1_FB_FLAGS_REGISTERED (1u << 0)    // Is this framebuffer device registered ?
+#define PYNQZ1_FB_FLAGS_SHADOW     (1u << 1)    // Does software draw into the shadow surface ?
+
+#define PYNQZ1_FB_PENDING_FLUSH 0   // Start writing the damaged region at the next vertical blanking.
+#define PYNQZ1_FB_PENDING_FLIP  1   // Show shadow_frame at the next vertical blanking.
 
 /* register access functions */
 static u32 dynclk_read_reg(struct pynqz1_fb_device* fbdev, u32 offset) { return ioread32(fbdev->reg_dynclk + offset); }
@@ -322,41 +472,1176 @@ static u32 dynclk_calculate_divider(u32 divisor)
 }
 
 /**
- * Calculate divider register value from target divisor.
- * Ported from video_display.c in PYNQ source code>
+ * Calculate divider register value from target divisor.
+ * Ported from video_display.c in PYNQ source code>
+ */
+static u32 dynclk_calculate_divider_config(u32 divisor)
+{
+    u32 divider = dynclk_calculate_divider(divisor);
+    return (divider & 0xfffu) | ((divider & 0x3000u) << 10);
+}
+
+/**
+ * Set the framebuffer hardware blank state.
+ */
+static int pynqz1_fb_blank(int blank_mode, struct fb_info *fbi)
+{
+    struct pynqz1_fb_device* fbdev = ((struct pynqz1_fb_layer*)fbi->par)->fbdev;
+
+    // Release back buffers if the display stays blanked.
+    if( blank_mode == FB_BLANK_UNBLANK ) {
+        cancel_delayed_work(&fbdev->release_work);
+    }
+    else if( fbdev->number_of_frames > 1 && !(fbdev->flags & PYNQZ1_FB_FLAGS_SHADOW) ) {
+        // The frames of the double buffered shadow surface are always in use.
+        schedule_delayed_work(&fbdev->release_work, msecs_to_jiffies(FRAME_RELEASE_DELAY_MS));
+    }
+    return 0;
+}
+
+static void pynqz1_fb_damage(struct pynqz1_fb_device* fbdev, u32 x, u32 y, u32 width, u32 height);
+
+/**
+ * Set pseudo color palette.
+ */
+static int pynqz1_fb_setcolreg(u_int regno, u_int red, u_int green, u_int blue, u_int transp, struct fb_info* info)
+{
+	u32 *palette = info->pseudo_palette;
+
+    if( info->fix.visual == FB_VISUAL_PSEUDOCOLOR ) {
+        // Palette of the 8bpp drawing surface. Changing a color rewrites the whole scanout frame.
+        struct pynqz1_fb_device* fbdev = ((struct pynqz1_fb_layer*)info->par)->fbdev;
+        u32 color = ((red >> 8) << RED_SHIFT) | ((green >> 8) << GREEN_SHIFT) | ((blue >> 8) << BLUE_SHIFT);
+        if( regno >= PALETTE_8BPP_ENTRIES ) {
+            return -EINVAL;
+        }
+        if( fbdev->palette[regno] != color ) {
+            fbdev->palette[regno] = color;
+            pynqz1_fb_damage(fbdev, 0, 0, info->var.xres, info->var.yres);
+        }
+        return 0;
+    }
+
+	if (regno >= PALETTE_ENTRIES_NO) {
+        return -EINVAL;
+    }
+	
+	red >>= 8;
+	green >>= 8;
+	blue >>= 8;
+	palette[regno] = (red << RED_SHIFT) | (green << GREEN_SHIFT) | (blue << BLUE_SHIFT);
+    if( info->var.transp.length != 0 ) {
+        palette[regno] |= 0xffu << info->var.transp.offset;  // Console colors on overlays are opaque.
+    }
+
+	return 0;
+}
+
+/**
+ * Request writing the damaged region to the scanout frame.
+ * If the VTC interrupt is available, the flush is started at the next vertical blanking.
+ * With a single frame, the flush runs on a work queue and writes the frame being scanned out, so a large update may tear.
+ * With two frames, the flush writes the frame not shown, which is flipped at the following vertical blanking.
+ */
+static void pynqz1_fb_schedule_flush(struct pynqz1_fb_device* fbdev)
+{
+    if( fbdev->irq > 0 ) {
+        set_bit(PYNQZ1_FB_PENDING_FLUSH, &fbdev->pending);
+    }
+    else {
+        schedule_delayed_work(&fbdev->flush_work, msecs_to_jiffies(SHADOW_FLUSH_DELAY_MS));
+    }
+}
+
+/**
+ * Add a rectangle of the primary surface to the damaged region and schedule writing it to the scanout frame.
+ */
+static void pynqz1_fb_damage(struct pynqz1_fb_device* fbdev, u32 x, u32 y, u32 width, u32 height)
+{
+    struct pynqz1_fb_damage* damage = &fbdev->damage;
+    u32 xres = fbdev->info.var.xres;
+    u32 yres = fbdev->info.var.yres;
+    unsigned long flags;
+
+    if( !(fbdev->flags & PYNQZ1_FB_FLAGS_SHADOW) ) return;
+    if( x >= xres || y >= yres || width == 0 || height == 0 ) return;
+    width  = min(width,  xres - x);
+    height = min(height, yres - y);
+
+    spin_lock_irqsave(&fbdev->damage_lock, flags);
+    if( damage->x1 >= damage->x2 ) {
+        damage->x1 = x;
+        damage->y1 = y;
+        damage->x2 = x + width;
+        damage->y2 = y + height;
+    }
+    else {
+        damage->x1 = min(damage->x1, x);
+        damage->y1 = min(damage->y1, y);
+        damage->x2 = max(damage->x2, x + width);
+        damage->y2 = max(damage->y2, y + height);
+    }
+    spin_unlock_irqrestore(&fbdev->damage_lock, flags);
+
+    pynqz1_fb_schedule_flush(fbdev);
+}
+
+/**
+ * Add a rectangle of a layer to the damaged region of the primary surface.
+ */
+static void pynqz1_fb_layer_damage(struct pynqz1_fb_layer* layer, u32 x, u32 y, u32 width, u32 height)
+{
+    s64 x1 = (s64)layer->x + x;
+    s64 y1 = (s64)layer->y + y;
+    s64 x2 = x1 + width;
+    s64 y2 = y1 + height;
+
+    x1 = max_t(s64, x1, 0);
+    y1 = max_t(s64, y1, 0);
+    if( x2 <= x1 || y2 <= y1 ) return;
+    pynqz1_fb_damage(layer->fbdev, (u32)x1, (u32)y1, (u32)min_t(s64, x2 - x1, U32_MAX), (u32)min_t(s64, y2 - y1, U32_MAX));
+}
+
+/**
+ * Add whole lines of a layer which contain the byte range of its shadow surface to the damaged region.
+ */
+static void pynqz1_fb_damage_range(struct pynqz1_fb_layer* layer, unsigned long offset, unsigned long length)
+{
+    u32 line_length = layer->info->fix.line_length;
+    u32 y1 = offset / line_length;
+    u32 y2 = (offset + length + line_length - 1) / line_length;
+
+    pynqz1_fb_layer_damage(layer, 0, y1, layer->info->var.xres, y2 - y1);
+}
+
+/**
+ * Write protect the shadow surface pages of a layer modified through user mappings again,
+ * and add the lines they contain to the damaged region.
+ */
+static void pynqz1_fb_collect_dirty_pages(struct pynqz1_fb_layer* layer)
+{
+    unsigned long pages = layer->shadow_size >> PAGE_SHIFT;
+    unsigned long index;
+
+    for_each_set_bit(index, layer->dirty_pages, pages) {
+        struct page* page = vmalloc_to_page(layer->shadow + (index << PAGE_SHIFT));
+
+        // Clear the bit before cleaning the page, so that a write after this point faults and marks it again.
+        clear_bit(index, layer->dirty_pages);
+        lock_page(page);
+        page_mkclean(page);
+        unlock_page(page);
+        pynqz1_fb_damage_range(layer, index << PAGE_SHIFT, PAGE_SIZE);
+    }
+}
+
+/**
+ * Write a rectangle of a surface which has the geometry of the primary surface to the scanout frame,
+ * converting it for the output.
+ */
+static void pynqz1_fb_blit(struct pynqz1_fb_device* fbdev, u32 index, const u8* src, u32 x, u32 y, u32 width, u32 height)
+{
+    u8* frame = fbdev->frame[index].virt;
+    u32 src_stride = fbdev->info.fix.line_length;
+
+    if( fbdev->bits_per_pixel == 8 ) {
+        pynqz1_blit_expand8(frame, fbdev->stride, src, src_stride, fbdev->palette, fbdev->line_buffer,
+                            x, y, width, height);
+    }
+    else if( fbdev->scale > 1 ) {
+        pynqz1_blit_upscale(frame, fbdev->stride, src, src_stride, fbdev->scale, fbdev->line_buffer,
+                            x, y, width, height);
+    }
+    else {
+        pynqz1_blit_rotate(frame, fbdev->stride, src, src_stride,
+                           fbdev->info.var.xres, fbdev->info.var.yres, fbdev->rotate, fbdev->line_buffer,
+                           x, y, width, height);
+    }
+}
+
+/**
+ * Mark the readback tiles which contain a rectangle of the primary surface as changed.
+ * The rectangle is converted to the scanout frame coordinates in the same way as pynqz1_fb_blit.
+ * Must be called with flush_lock held.
+ */
+static void pynqz1_fb_readback_damage(struct pynqz1_fb_device* fbdev, u32 x, u32 y, u32 width, u32 height)
+{
+    u32 xres = fbdev->info.var.xres;
+    u32 yres = fbdev->info.var.yres;
+    u32 ox, oy, ow, oh;
+    u32 column, row;
+
+    switch(fbdev->rotate) {
+    case 90:  ox = yres - y - height; oy = x;                 ow = height; oh = width;  break;
+    case 180: ox = xres - x - width;  oy = yres - y - height; ow = width;  oh = height; break;
+    case 270: ox = y;                 oy = xres - x - width;  ow = height; oh = width;  break;
+    default:
+        ox = x*fbdev->scale;
+        oy = y*fbdev->scale;
+        ow = width*fbdev->scale;
+        oh = height*fbdev->scale;
+        break;
+    }
+    column = ox / READBACK_TILE_SIZE;
+    for(row = oy / READBACK_TILE_SIZE; row <= (oy + oh - 1) / READBACK_TILE_SIZE; row++) {
+        bitmap_set(fbdev->readback_dirty, row*fbdev->readback_columns + column, (ox + ow - 1) / READBACK_TILE_SIZE - column + 1);
+    }
+}
+
+/**
+ * Mark the readback tiles which contain a rectangle reported by PYNQZ1_FB_IOCTL_DAMAGE without the shadow surface.
+ */
+static void pynqz1_fb_readback_report(struct pynqz1_fb_device* fbdev, u32 x, u32 y, u32 width, u32 height)
+{
+    if( x >= fbdev->width || y >= fbdev->height || width == 0 || height == 0 ) return;
+    width  = min(width,  fbdev->width - x);
+    height = min(height, fbdev->height - y);
+
+    mutex_lock(&fbdev->flush_lock);
+    pynqz1_fb_readback_damage(fbdev, x, y, width, height);
+    fbdev->readback_reported = 1;
+    mutex_unlock(&fbdev->flush_lock);
+}
+
+/**
+ * Copy the readback tiles changed since they were last read to the user buffer.
+ * Without the shadow surface, the tiles reported by PYNQZ1_FB_IOCTL_DAMAGE are copied.
+ * If nothing was reported since the last read, changes are detected by comparing hashes of the tiles in the scanout frame instead.
+ * Each line of a tile is copied from the uncached frame to the cached line buffer in bursts before it is hashed or copied to the user.
+ */
+static int pynqz1_fb_read_tiles(struct pynqz1_fb_device* fbdev, struct pynqz1_fb_tile_read* request)
+{
+    u8 __user* buffer = (u8 __user*)(unsigned long)request->buffer;
+    u32 number_of_tiles = fbdev->readback_columns*fbdev->readback_rows;
+    unsigned long index;
+    unsigned long flags;
+    u32 shown;
+    const u8* frame;
+    int rc = 0;
+
+    // Pin the frame being shown so that it is not released while it is copied.
+    // frame_lock itself is not held across copy_to_user, because a page fault there takes mmap_sem,
+    // which mmap holds while it takes frame_lock.
+    mutex_lock(&fbdev->frame_lock);
+    spin_lock_irqsave(&fbdev->present_lock, flags);
+    shown = fbdev->present_status.buffer;
+    spin_unlock_irqrestore(&fbdev->present_lock, flags);
+    fbdev->frame[shown].readers++;
+    frame = fbdev->frame[shown].virt;
+    mutex_unlock(&fbdev->frame_lock);
+
+    request->length = 0;
+    request->tiles = 0;
+    request->remaining = 0;
+    request->frame_width = fbdev->width;
+    request->frame_height = fbdev->height;
+    request->tile_size = READBACK_TILE_SIZE;
+
+    mutex_lock(&fbdev->flush_lock);
+    if( fbdev->flags & PYNQZ1_FB_FLAGS_SHADOW ) {
+        // The frame written last has the latest content even before it is flipped. These frames are never released.
+        frame = fbdev->frame[fbdev->shadow_frame].virt;
+    }
+    if( request->flags & PYNQZ1_FB_TILE_READ_ALL ) {
+        bitmap_fill(fbdev->readback_dirty, number_of_tiles);
+    }
+    if( fbdev->readback_hashes != NULL && !fbdev->readback_reported ) {
+        for(index = 0; index < number_of_tiles; index++) {
+            u32 tx = (index % fbdev->readback_columns)*READBACK_TILE_SIZE;
+            u32 ty = (index / fbdev->readback_columns)*READBACK_TILE_SIZE;
+            u32 tw = min_t(u32, READBACK_TILE_SIZE, fbdev->width - tx);
+            u32 th = min_t(u32, READBACK_TILE_SIZE, fbdev->height - ty);
+            u32 hash = PYNQZ1_BLIT_HASH_INIT;
+            u32 row;
+            for(row = 0; row < th; row++) {
+                memcpy(fbdev->line_buffer, frame + (ty + row)*fbdev->stride + tx*BYTES_PER_PIXEL, tw*BYTES_PER_PIXEL);
+                hash = pynqz1_blit_hash(hash, fbdev->line_buffer, 0, tw*BYTES_PER_PIXEL, 1);
+            }
+            if( hash != fbdev->readback_hashes[index] ) {
+                fbdev->readback_hashes[index] = hash;
+                set_bit(index, fbdev->readback_dirty);
+            }
+        }
+    }
+    fbdev->readback_reported = 0;
+
+    for_each_set_bit(index, fbdev->readback_dirty, number_of_tiles) {
+        struct pynqz1_fb_tile_header header;
+        u32 hash = PYNQZ1_BLIT_HASH_INIT;
+        u32 tile_size;
+        u32 row;
+
+        header.x      = (index % fbdev->readback_columns)*READBACK_TILE_SIZE;
+        header.y      = (index / fbdev->readback_columns)*READBACK_TILE_SIZE;
+        header.width  = min_t(u32, READBACK_TILE_SIZE, fbdev->width - header.x);
+        header.height = min_t(u32, READBACK_TILE_SIZE, fbdev->height - header.y);
+        tile_size = sizeof(header) + header.width*header.height*BYTES_PER_PIXEL;
+        if( request->size - request->length < tile_size ) {
+            request->remaining++;
+            continue;
+        }
+
+        if( copy_to_user(buffer + request->length, &header, sizeof(header)) ) {
+            rc = -EFAULT;
+            break;
+        }
+        for(row = 0; row < header.height; row++) {
+            u32 offset = request->length + sizeof(header) + row*header.width*BYTES_PER_PIXEL;
+            memcpy(fbdev->line_buffer, frame + (header.y + row)*fbdev->stride + header.x*BYTES_PER_PIXEL, header.width*BYTES_PER_PIXEL);
+            hash = pynqz1_blit_hash(hash, fbdev->line_buffer, 0, header.width*BYTES_PER_PIXEL, 1);
+            if( copy_to_user(buffer + offset, fbdev->line_buffer, header.width*BYTES_PER_PIXEL) ) {
+                rc = -EFAULT;
+                break;
+            }
+        }
+        if( rc ) {
+            break;
+        }
+        if( fbdev->readback_hashes != NULL ) {
+            fbdev->readback_hashes[index] = hash;   // Keep the hash of a reported tile up to date for the next hashing pass.
+        }
+        clear_bit(index, fbdev->readback_dirty);
+        request->length += tile_size;
+        request->tiles++;
+    }
+    mutex_unlock(&fbdev->flush_lock);
+
+    mutex_lock(&fbdev->frame_lock);
+    fbdev->frame[shown].readers--;
+    mutex_unlock(&fbdev->frame_lock);
+    return rc;
+}
+
+/**
+ * Compose a rectangle of the primary surface and the overlays above it into the compose surface.
+ * Must be called with flush_lock held.
+ */
+static void pynqz1_fb_compose(struct pynqz1_fb_device* fbdev, u32 x, u32 y, u32 width, u32 height)
+{
+    struct pynqz1_fb_layer* layers[MAX_OVERLAYS];
+    u32 stride = fbdev->info.fix.line_length;
+    u32 count = 0;
+    u32 i;
+
+    // Sort visible overlays by z-order. Overlays with the same z-order are stacked in the creation order.
+    for(i = 0; i < fbdev->number_of_overlays; i++) {
+        struct pynqz1_fb_layer* layer = fbdev->overlays[i];
+        u32 j;
+        if( layer == NULL || !layer->registered || !layer->visible || layer->alpha == 0 ) continue;
+        for(j = count; j > 0 && layers[j - 1]->zorder > layer->zorder; j--) {
+            layers[j] = layers[j - 1];
+        }
+        layers[j] = layer;
+        count++;
+    }
+
+    pynqz1_blit_copy(fbdev->compose, stride, fbdev->primary.shadow, stride, x, y, width, height);
+    for(i = 0; i < count; i++) {
+        struct pynqz1_fb_layer* layer = layers[i];
+        u32 layer_stride = layer->info->fix.line_length;
+        // Intersection of the rectangle and the overlay in the primary surface coordinates.
+        s64 x1 = max_t(s64, x, layer->x);
+        s64 y1 = max_t(s64, y, layer->y);
+        s64 x2 = min_t(s64, (s64)x + width,  (s64)layer->x + layer->info->var.xres);
+        s64 y2 = min_t(s64, (s64)y + height, (s64)layer->y + layer->info->var.yres);
+        if( x2 <= x1 || y2 <= y1 ) continue;
+
+        pynqz1_blit_blend(fbdev->compose + y1*stride + x1*BYTES_PER_PIXEL, stride,
+                          layer->shadow + (y1 - layer->y)*layer_stride + (x1 - layer->x)*OVERLAY_BYTES_PER_PIXEL, layer_stride,
+                          layer->alpha, (u32)(x2 - x1), (u32)(y2 - y1));
+    }
+}
+
+/**
+ * Write the damaged region of the surfaces to the scanout frame.
+ */
+static u64 pynqz1_fb_vblank_count(struct pynqz1_fb_device* fbdev)
+{
+    unsigned long flags;
+    u64 count;
+
+    spin_lock_irqsave(&fbdev->present_lock, flags);
+    count = fbdev->present_status.vblank_count;
+    spin_unlock_irqrestore(&fbdev->present_lock, flags);
+    return count;
+}
+
+/**
+ * Wait until VDMA does not read a frame of the double buffered shadow surface, so that it can be written.
+ * The frame requested by the previous flush is shown at the next vertical blanking,
+ * and VDMA switches to it at its next frame start. Must be called with flush_lock held.
+ */
+static void pynqz1_fb_wait_for_flip(struct pynqz1_fb_device* fbdev, u32 index)
+{
+    u64 count;
+
+    wait_event_timeout(fbdev->vblank_wait, !test_bit(PYNQZ1_FB_PENDING_FLIP, &fbdev->pending), msecs_to_jiffies(FLIP_TIMEOUT_MS));
+    count = pynqz1_fb_vblank_count(fbdev);
+    if( ((vdma_read_reg(fbdev, VDMA_REG_PARKPTR) & VDMA_PARKPTR_READSTR_MASK) >> VDMA_PARKPTR_READSTR_SHIFT) == index ) {
+        wait_event_timeout(fbdev->vblank_wait, pynqz1_fb_vblank_count(fbdev) != count, msecs_to_jiffies(FLIP_TIMEOUT_MS));
+    }
+}
+
+static void pynqz1_fb_flush(struct work_struct* work)
+{
+    struct pynqz1_fb_device* fbdev = container_of(to_delayed_work(work), struct pynqz1_fb_device, flush_work);
+    struct pynqz1_fb_damage damage;
+    unsigned long flags;
+    u32 i;
+
+    mutex_lock(&fbdev->flush_lock);
+    pynqz1_fb_collect_dirty_pages(&fbdev->primary);
+    for(i = 0; i < fbdev->number_of_overlays; i++) {
+        if( fbdev->overlays[i] != NULL && fbdev->overlays[i]->registered ) {
+            pynqz1_fb_collect_dirty_pages(fbdev->overlays[i]);
+        }
+    }
+
+    spin_lock_irqsave(&fbdev->damage_lock, flags);
+    damage = fbdev->damage;
+    fbdev->damage.x1 = fbdev->damage.x2 = 0;
+    spin_unlock_irqrestore(&fbdev->damage_lock, flags);
+
+    if( damage.x1 < damage.x2 ) {
+        struct pynqz1_fb_damage region = damage;
+        u32 index = 0;
+        u32 width, height;
+
+        if( fbdev->number_of_frames > 1 ) {
+            // Write the frame not shown. It also lacks the region written into the other frame by the previous flush.
+            index = fbdev->shadow_frame ^ 1;
+            pynqz1_fb_wait_for_flip(fbdev, index);
+            if( fbdev->flip_damage.x1 < fbdev->flip_damage.x2 ) {
+                region.x1 = min(region.x1, fbdev->flip_damage.x1);
+                region.y1 = min(region.y1, fbdev->flip_damage.y1);
+                region.x2 = max(region.x2, fbdev->flip_damage.x2);
+                region.y2 = max(region.y2, fbdev->flip_damage.y2);
+            }
+        }
+        width  = region.x2 - region.x1;
+        height = region.y2 - region.y1;
+        if( fbdev->compose != NULL ) {
+            pynqz1_fb_compose(fbdev, region.x1, region.y1, width, height);
+            pynqz1_fb_blit(fbdev, index, fbdev->compose, region.x1, region.y1, width, height);
+        }
+        else {
+            pynqz1_fb_blit(fbdev, index, fbdev->primary.shadow, region.x1, region.y1, width, height);
+        }
+        pynqz1_fb_readback_damage(fbdev, damage.x1, damage.y1, damage.x2 - damage.x1, damage.y2 - damage.y1);
+
+        if( fbdev->number_of_frames > 1 ) {
+            fbdev->flip_damage = damage;
+            fbdev->shadow_frame = index;
+            smp_mb__before_atomic();    // Make shadow_frame visible to the interrupt handler before the request.
+            set_bit(PYNQZ1_FB_PENDING_FLIP, &fbdev->pending);
+        }
+    }
+    mutex_unlock(&fbdev->flush_lock);
+}
+
+/**
+ * Allocate a frame if it is not allocated yet and set it to the VDMA frame store.
+ * Must be called with frame_lock held.
+ */
+static int pynqz1_fb_frame_alloc(struct pynqz1_fb_device* fbdev, u32 index)
+{
+    struct pynqz1_frame* frame = &fbdev->frame[index];
+    u32 fbsize = GET_FB_SIZE(fbdev);
+
+    if( frame->virt != NULL ) {
+        return 0;
+    }
+    // dma_alloc_coherent clears the buffer, so it is not cleared again here.
+    frame->virt = dma_alloc_coherent(fbdev->dev, fbsize, &frame->phys, GFP_KERNEL);
+    if( frame->virt == NULL ) {
+        dev_err(fbdev->dev, "Failed to allocate frame %d\n", index);
+        return -ENOMEM;
+    }
+    fbdev->cma_usage += fbsize;
+    fbdev->cma_peak = max(fbdev->cma_peak, fbdev->cma_usage);
+
+    if( index != 0 && fbdev->reg_vdma != NULL ) {
+        // Frame 0 is set when VDMA is initialized. Back buffers are allocated after that.
+        vdma_write_reg(fbdev, VDMA_REG_MM2S_ADDR+VDMA_REG_START_ADDR+index*VDMA_START_ADDR_LEN, frame->phys);
+        vdma_write_reg(fbdev, VDMA_REG_MM2S_ADDR+VDMA_REG_VSIZE, fbdev->height);  // Start addresses take effect by writing VSIZE.
+    }
+    return 0;
+}
+
+/**
+ * Release a frame. Must be called with frame_lock held.
+ */
+static void pynqz1_fb_frame_free(struct pynqz1_fb_device* fbdev, u32 index)
+{
+    struct pynqz1_frame* frame = &fbdev->frame[index];
+    u32 fbsize = GET_FB_SIZE(fbdev);
+
+    if( frame->virt == NULL ) {
+        return;
+    }
+    if( index != 0 && fbdev->reg_vdma != NULL && fbdev->frame[0].virt != NULL ) {
+        // Point the frame store to frame 0 again.
+        vdma_write_reg(fbdev, VDMA_REG_MM2S_ADDR+VDMA_REG_START_ADDR+index*VDMA_START_ADDR_LEN, fbdev->frame[0].phys);
+        vdma_write_reg(fbdev, VDMA_REG_MM2S_ADDR+VDMA_REG_VSIZE, fbdev->height);
+    }
+    dma_free_coherent(fbdev->dev, fbsize, frame->virt, frame->phys);
+    frame->virt = NULL;
+    fbdev->cma_usage -= fbsize;
+}
+
+/**
+ * Make VDMA read the frame from the next frame start.
+ */
+static void pynqz1_fb_show_frame(struct pynqz1_fb_device* fbdev, u32 index)
+{
+    u32 parkPtr = vdma_read_reg(fbdev, VDMA_REG_PARKPTR);
+    parkPtr &= ~VDMA_PARKPTR_READREF_MASK;
+    parkPtr |= index & VDMA_PARKPTR_READREF_MASK;
+    vdma_write_reg(fbdev, VDMA_REG_PARKPTR, parkPtr);
+}
+
+/**
+ * Check if the target of a presentation queue entry has come at the vertical blanking.
+ * A timestamp target is assigned to the vertical blanking nearest to it.
+ */
+static int pynqz1_fb_present_ready(struct pynqz1_fb_device* fbdev, const struct pynqz1_fb_present_entry* entry, u64 count, u64 now)
+{
+    if( entry->flags & PYNQZ1_FB_PRESENT_TIMESTAMP ) {
+        return entry->target <= now + fbdev->vblank_period/2;
+    }
+    return entry->target <= count;
+}
+
+/**
+ * Check if a presentation queue entry shown at the vertical blanking missed an earlier vertical blanking nearer to its target.
+ */
+static int pynqz1_fb_present_late(struct pynqz1_fb_device* fbdev, const struct pynqz1_fb_present_entry* entry, u64 count, u64 now)
+{
+    if( entry->flags & PYNQZ1_FB_PRESENT_TIMESTAMP ) {
+        return now > entry->target + fbdev->vblank_period/2;
+    }
+    return count > entry->target;
+}
+
+/**
+ * Count a vertical blanking and service the presentation queue.
+ * Called from the VTC interrupt handler.
+ */
+static void pynqz1_fb_present_vblank(struct pynqz1_fb_device* fbdev)
+{
+    struct pynqz1_fb_present_status* status = &fbdev->present_status;
+    struct pynqz1_fb_present_entry selected;
+    int has_selected = 0;
+    u64 now = ktime_to_ns(ktime_get());
+    u64 count;
+
+    spin_lock(&fbdev->present_lock);
+    if( status->vblank_count > 0 ) {
+        fbdev->vblank_period = now - status->vblank_time;
+    }
+    count = ++status->vblank_count;
+    status->vblank_time = now;
+
+    while( status->queued > 0 ) {
+        struct pynqz1_fb_present_entry* entry = &fbdev->present_queue[fbdev->present_head];
+        if( !pynqz1_fb_present_ready(fbdev, entry, count, now) ) {
+            break;
+        }
+        if( has_selected ) {
+            status->skipped++;  // A newer entry is also ready.
+        }
+        selected = *entry;
+        has_selected = 1;
+        fbdev->present_head = (fbdev->present_head + 1) % PRESENT_QUEUE_DEPTH;
+        status->queued--;
+        if( status->mode == PYNQZ1_FB_PRESENT_MODE_FIFO ) {
+            break;
+        }
+    }
+    if( has_selected ) {
+        pynqz1_fb_show_frame(fbdev, selected.buffer);
+        status->buffer = selected.buffer;
+        status->last_sequence = selected.sequence;
+        status->last_vblank = count;
+        status->last_time = now;
+        status->presented++;
+        if( pynqz1_fb_present_late(fbdev, &selected, count, now) ) {
+            status->late++;
+        }
+    }
+    spin_unlock(&fbdev->present_lock);
+
+    wake_up_all(&fbdev->vblank_wait);
+}
+
+/**
+ * Add an entry to the presentation queue.
+ */
+static int pynqz1_fb_present(struct pynqz1_fb_device* fbdev, struct pynqz1_fb_present* request)
+{
+    struct pynqz1_fb_present_status* status = &fbdev->present_status;
+    struct pynqz1_fb_present_entry* entry;
+    unsigned long flags;
+    int rc;
+
+    if( fbdev->irq == 0 ) {
+        return -ENODEV;
+    }
+    if( (fbdev->flags & PYNQZ1_FB_FLAGS_SHADOW) || request->buffer >= fbdev->number_of_frames ) {
+        return -EINVAL;
+    }
+    if( request->flags & ~PYNQZ1_FB_PRESENT_TIMESTAMP ) {
+        return -EINVAL;
+    }
+
+    // Hold frame_lock until the entry is queued, so that the frame is not released before it.
+    mutex_lock(&fbdev->frame_lock);
+    rc = pynqz1_fb_frame_alloc(fbdev, request->buffer);
+    if( rc ) {
+        mutex_unlock(&fbdev->frame_lock);
+        return rc;
+    }
+    spin_lock_irqsave(&fbdev->present_lock, flags);
+    if( status->queued == PRESENT_QUEUE_DEPTH ) {
+        if( status->mode == PYNQZ1_FB_PRESENT_MODE_FIFO ) {
+            spin_unlock_irqrestore(&fbdev->present_lock, flags);
+            mutex_unlock(&fbdev->frame_lock);
+            return -EAGAIN;
+        }
+        // Drop the oldest entry.
+        fbdev->present_head = (fbdev->present_head + 1) % PRESENT_QUEUE_DEPTH;
+        status->queued--;
+        status->skipped++;
+    }
+    entry = &fbdev->present_queue[(fbdev->present_head + status->queued) % PRESENT_QUEUE_DEPTH];
+    entry->buffer   = request->buffer;
+    entry->flags    = request->flags;
+    entry->target   = request->target;
+    entry->sequence = fbdev->present_sequence++;
+    status->queued++;
+    request->sequence = entry->sequence;
+    spin_unlock_irqrestore(&fbdev->present_lock, flags);
+    mutex_unlock(&fbdev->frame_lock);
+    return 0;
+}
+
+/**
+ * Release the back buffers which are neither shown, queued, mapped nor being read.
+ * Scheduled when the display is blanked.
+ */
+static void pynqz1_fb_release_frames(struct work_struct* work)
+{
+    struct pynqz1_fb_device* fbdev = container_of(to_delayed_work(work), struct pynqz1_fb_device, release_work);
+    unsigned long flags;
+    u32 queued;
+    u32 shown;
+    u32 i;
+
+    mutex_lock(&fbdev->frame_lock);
+    spin_lock_irqsave(&fbdev->present_lock, flags);
+    queued = fbdev->present_status.queued;
+    shown = fbdev->present_status.buffer;
+    spin_unlock_irqrestore(&fbdev->present_lock, flags);
+
+    if( fbdev->frame_mapped == 0 && queued == 0 ) {
+        for(i = 1; i < fbdev->number_of_frames; i++) {
+            if( i != shown && fbdev->frame[i].readers == 0 ) {
+                pynqz1_fb_frame_free(fbdev, i);
+            }
+        }
+    }
+    mutex_unlock(&fbdev->frame_lock);
+}
+
+/**
+ * Wait for the next vertical blanking.
+ */
+static int pynqz1_fb_wait_for_vsync(struct pynqz1_fb_device* fbdev)
+{
+    u64 count;
+    long rc;
+
+    if( fbdev->irq == 0 ) {
+        return -ENODEV;
+    }
+    count = pynqz1_fb_vblank_count(fbdev);
+    rc = wait_event_interruptible_timeout(fbdev->vblank_wait, pynqz1_fb_vblank_count(fbdev) != count, msecs_to_jiffies(100));
+    if( rc < 0 ) {
+        return rc;
+    }
+    return rc == 0 ? -ETIMEDOUT : 0;
+}
+
+/**
+ * Handle the VTC interrupt.
+ * Service the presentation queue and start writing the damaged region at the vertical blanking.
+ */
+static irqreturn_t pynqz1_fb_vtc_irq(int irq, void* data)
+{
+    struct pynqz1_fb_device* fbdev = data;
+    u32 status = vtc_read_reg(fbdev, VTC_REG_ISR) & VTC_IXR_G_VBLANK_MASK;
+
+    if( !status ) {
+        return IRQ_NONE;
+    }
+    vtc_write_reg(fbdev, VTC_REG_ISR, status);  // Write 1 to clear.
+
+    // Flip before waking up the flush waiting for it in pynqz1_fb_present_vblank.
+    if( test_and_clear_bit(PYNQZ1_FB_PENDING_FLIP, &fbdev->pending) ) {
+        pynqz1_fb_show_frame(fbdev, fbdev->shadow_frame);
+    }
+    pynqz1_fb_present_vblank(fbdev);
+    if( test_and_clear_bit(PYNQZ1_FB_PENDING_FLUSH, &fbdev->pending) ) {
+        schedule_delayed_work(&fbdev->flush_work, 0);
+    }
+    return IRQ_HANDLED;
+}
+
+static void pynqz1_fb_shadow_fillrect(struct fb_info* info, const struct fb_fillrect* rect)
+{
+    sys_fillrect(info, rect);
+    pynqz1_fb_layer_damage(info->par, rect->dx, rect->dy, rect->width, rect->height);
+}
+
+static void pynqz1_fb_shadow_copyarea(struct fb_info* info, const struct fb_copyarea* area)
+{
+    sys_copyarea(info, area);
+    pynqz1_fb_layer_damage(info->par, area->dx, area->dy, area->width, area->height);
+}
+
+static void pynqz1_fb_shadow_imageblit(struct fb_info* info, const struct fb_image* image)
+{
+    sys_imageblit(info, image);
+    pynqz1_fb_layer_damage(info->par, image->dx, image->dy, image->width, image->height);
+}
+
+/**
+ * Restore the pixels under the cursor.
+ * A pixel which has been overwritten since the cursor was drawn is left as it is.
+ */
+static void pynqz1_fb_cursor_restore(struct fb_info* info, struct pynqz1_fb_cursor* cursor)
+{
+    u32 bpp = info->var.bits_per_pixel/8;
+    u8* screen = (u8*)info->screen_base;
+    const u8* saved = cursor->saved;
+    const u8* drawn = cursor->drawn;
+    u32 row, column;
+
+    if( !cursor->shown ) return;
+    cursor->shown = 0;
+
+    for(row = 0; row < cursor->height; row++) {
+        u8* p = screen + (cursor->y + row)*info->fix.line_length + cursor->x*bpp;
+        const u8* mask = cursor->mask + row*cursor->pitch;
+        for(column = 0; column < cursor->width; column++, p += bpp) {
+            if( !(mask[column/8] & (0x80u >> (column & 7))) ) continue;
+            if( memcmp(p, drawn, bpp) == 0 ) {
+                memcpy(p, saved, bpp);
+            }
+            saved += bpp;
+            drawn += bpp;
+        }
+    }
+}
+
+/**
+ * Draw the cursor, saving the pixels under its mask.
+ * Unlike soft_cursor, which redraws the whole character cell with imageblit,
+ * only the pixels under the mask are read and written.
+ */
+static int pynqz1_fb_cursor(struct fb_info* info, struct fb_cursor* request)
+{
+    struct pynqz1_fb_layer* layer = info->par;
+    struct pynqz1_fb_device* fbdev = layer->fbdev;
+    struct pynqz1_fb_cursor* cursor = &fbdev->cursor;
+    const struct fb_image* image = &request->image;
+    u32 bpp = info->var.bits_per_pixel/8;
+    u8* screen = (u8*)info->screen_base;
+    u32 pitch = DIV_ROUND_UP(image->width, 8);
+    u32 colors[2];
+    u8* saved = cursor->saved;
+    u8* drawn = cursor->drawn;
+    u32 row, column;
+
+    // Erase the cursor drawn previously. This is done even for a request rejected below,
+    // as soft_cursor which takes over does not know about it.
+    if( cursor->shown ) {
+        pynqz1_fb_cursor_restore(info, cursor);
+        pynqz1_fb_layer_damage(layer, cursor->x, cursor->y, cursor->width, cursor->height);
+    }
+    if( image->width > CURSOR_MAX_SIZE || image->height > CURSOR_MAX_SIZE || image->depth != 1 || bpp > CURSOR_MAX_BYTES_PER_PIXEL ) {
+        return -EINVAL; // Let the caller fall back to soft_cursor.
+    }
+    if( !request->enable || request->mask == NULL || image->dx >= info->var.xres || image->dy >= info->var.yres ) {
+        return 0;
+    }
+
+    cursor->x = image->dx;
+    cursor->y = image->dy;
+    cursor->width  = min_t(u32, image->width,  info->var.xres - image->dx);
+    cursor->height = min_t(u32, image->height, info->var.yres - image->dy);
+    cursor->pitch = pitch;
+    memcpy(cursor->mask, request->mask, pitch*image->height);
+
+    if( info->fix.visual == FB_VISUAL_TRUECOLOR ) {
+        colors[0] = ((u32*)info->pseudo_palette)[image->bg_color];
+        colors[1] = ((u32*)info->pseudo_palette)[image->fg_color];
+    }
+    else {
+        colors[0] = image->bg_color;
+        colors[1] = image->fg_color;
+    }
+
+    for(row = 0; row < cursor->height; row++) {
+        u8* p = screen + (cursor->y + row)*info->fix.line_length + cursor->x*bpp;
+        const u8* mask = cursor->mask + row*pitch;
+        const u8* glyph = image->data != NULL ? (const u8*)image->data + row*pitch : NULL;
+        for(column = 0; column < cursor->width; column++, p += bpp) {
+            u32 bit = 0x80u >> (column & 7);
+            u32 foreground;
+            u32 color;
+            u32 i;
+
+            if( !(mask[column/8] & bit) ) continue;
+            // Same as soft_cursor, which draws data ^ mask by XOR and data & ~mask by COPY:
+            // the glyph is inverted by XOR, and the mask is painted in the background color by COPY.
+            foreground = request->rop == ROP_XOR ? !(glyph != NULL && (glyph[column/8] & bit)) : 0;
+            color = colors[foreground];
+            memcpy(saved, p, bpp);
+            for(i = 0; i < bpp; i++) {
+                drawn[i] = (u8)(color >> (i*8));
+            }
+            memcpy(p, drawn, bpp);
+            saved += bpp;
+            drawn += bpp;
+        }
+    }
+    cursor->shown = 1;
+    pynqz1_fb_layer_damage(layer, cursor->x, cursor->y, cursor->width, cursor->height);
+    return 0;
+}
+
+static ssize_t pynqz1_fb_shadow_write(struct fb_info* info, const char __user* buf, size_t count, loff_t* ppos)
+{
+    loff_t offset = *ppos;
+    ssize_t rc = fb_sys_write(info, buf, count, ppos);
+
+    if( rc > 0 ) {
+        pynqz1_fb_damage_range(info->par, offset, rc);
+    }
+    return rc;
+}
+
+/**
+ * Map a page of the shadow surface into the user mapping.
+ * The page is associated with the mapping of the device file so that page_mkclean() can find the mapping.
+ */
+static int pynqz1_fb_shadow_fault(struct vm_area_struct* vma, struct vm_fault* vmf)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)vma->vm_private_data)->par;
+    unsigned long offset = vmf->pgoff << PAGE_SHIFT;
+    struct page* page;
+
+    if( offset >= layer->shadow_size ) {
+        return VM_FAULT_SIGBUS;
+    }
+    page = vmalloc_to_page(layer->shadow + offset);
+    if( !page ) {
+        return VM_FAULT_SIGBUS;
+    }
+    get_page(page);
+    if( vma->vm_file ) {
+        page->mapping = vma->vm_file->f_mapping;
+    }
+    page->index = vmf->pgoff;
+
+    vmf->page = page;
+    return 0;
+}
+
+/**
+ * Record the first write to a clean page of the shadow surface through the user mapping.
+ */
+static int pynqz1_fb_shadow_page_mkwrite(struct vm_area_struct* vma, struct vm_fault* vmf)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)vma->vm_private_data)->par;
+
+    file_update_time(vma->vm_file);
+    lock_page(vmf->page);
+    set_bit(vmf->pgoff, layer->dirty_pages);
+    pynqz1_fb_schedule_flush(layer->fbdev);
+
+    return VM_FAULT_LOCKED;
+}
+
+static const struct vm_operations_struct pynqz1_fb_shadow_vm_ops = {
+    .fault          = pynqz1_fb_shadow_fault,
+    .page_mkwrite   = pynqz1_fb_shadow_page_mkwrite,
+};
+
+static int pynqz1_fb_shadow_set_page_dirty(struct page* page)
+{
+    if( !PageDirty(page) ) {
+        SetPageDirty(page);
+    }
+    return 0;
+}
+
+static const struct address_space_operations pynqz1_fb_shadow_aops = {
+    .set_page_dirty = pynqz1_fb_shadow_set_page_dirty,
+};
+
+/**
+ * Map the shadow surface to the user space.
+ * Pages are mapped on demand and write-protected, so that writes to them can be tracked.
+ */
+static int pynqz1_fb_shadow_mmap(struct fb_info* info, struct vm_area_struct* vma)
+{
+    struct pynqz1_fb_layer* layer = info->par;
+    unsigned long size = vma->vm_end - vma->vm_start;
+
+    if( vma->vm_pgoff > (layer->shadow_size >> PAGE_SHIFT) || size > layer->shadow_size - (vma->vm_pgoff << PAGE_SHIFT) ) {
+        return -EINVAL;
+    }
+    if( vma->vm_file ) {
+        vma->vm_file->f_mapping->a_ops = &pynqz1_fb_shadow_aops;
+    }
+    vma->vm_ops = &pynqz1_fb_shadow_vm_ops;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_private_data = info;
+    return 0;
+}
+
+static void pynqz1_fb_frame_vm_open(struct vm_area_struct* vma)
+{
+    struct pynqz1_fb_device* fbdev = vma->vm_private_data;
+    mutex_lock(&fbdev->frame_lock);
+    fbdev->frame_mapped++;
+    mutex_unlock(&fbdev->frame_lock);
+}
+
+static void pynqz1_fb_frame_vm_close(struct vm_area_struct* vma)
+{
+    struct pynqz1_fb_device* fbdev = vma->vm_private_data;
+    mutex_lock(&fbdev->frame_lock);
+    fbdev->frame_mapped--;
+    mutex_unlock(&fbdev->frame_lock);
+}
+
+/**
+ * Count the mappings of the frames, so that mapped frames are not released.
+ */
+static const struct vm_operations_struct pynqz1_fb_frame_vm_ops = {
+    .open  = pynqz1_fb_frame_vm_open,
+    .close = pynqz1_fb_frame_vm_close,
+};
+
+/**
+ * Map the frames to the user space. Frame i is mapped at offset i*GET_FB_SIZE.
+ * Frames which are not allocated yet are allocated here.
+ * smem_len only covers frame 0, because the frames are not contiguous in the physical memory.
+ */
+static int pynqz1_fb_mmap(struct fb_info* info, struct vm_area_struct* vma)
+{
+    struct pynqz1_fb_device* fbdev = ((struct pynqz1_fb_layer*)info->par)->fbdev;
+    u32 frame_size = GET_FB_SIZE(fbdev);
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    unsigned long total = (unsigned long)frame_size*fbdev->number_of_frames;
+    unsigned long mapped;
+    int rc = 0;
+
+    if( offset > total || size > total - offset ) {
+        return -EINVAL;
+    }
+    vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+
+    mutex_lock(&fbdev->frame_lock);
+    for(mapped = 0; mapped < size; ) {
+        u32 index = (offset + mapped) / frame_size;
+        u32 frame_offset = (offset + mapped) % frame_size;
+        unsigned long length = min_t(unsigned long, frame_size - frame_offset, size - mapped);
+
+        rc = pynqz1_fb_frame_alloc(fbdev, index);
+        if( rc ) {
+            break;
+        }
+        rc = remap_pfn_range(vma, vma->vm_start + mapped, (fbdev->frame[index].phys + frame_offset) >> PAGE_SHIFT, length, vma->vm_page_prot);
+        if( rc ) {
+            break;
+        }
+        mapped += length;
+    }
+    if( rc == 0 ) {
+        vma->vm_ops = &pynqz1_fb_frame_vm_ops;
+        vma->vm_private_data = fbdev;
+        fbdev->frame_mapped++;
+    }
+    mutex_unlock(&fbdev->frame_lock);
+    return rc;
+}
+
+/**
+ * Change placement of an overlay and damage both the old and the new area.
  */
-static u32 dynclk_calculate_divider_config(u32 divisor)
+static int pynqz1_fb_overlay_configure(struct pynqz1_fb_layer* layer, const struct pynqz1_fb_overlay_config* config)
 {
-    u32 divider = dynclk_calculate_divider(divisor);
-    return (divider & 0xfffu) | ((divider & 0x3000u) << 10);
+    struct pynqz1_fb_device* fbdev = layer->fbdev;
+
+    if( config->alpha > 255 ) {
+        return -EINVAL;
+    }
+    mutex_lock(&fbdev->flush_lock);
+    pynqz1_fb_layer_damage(layer, 0, 0, layer->info->var.xres, layer->info->var.yres);
+    layer->x      = config->x;
+    layer->y      = config->y;
+    layer->zorder = config->zorder;
+    layer->alpha  = config->alpha;
+    pynqz1_fb_layer_damage(layer, 0, 0, layer->info->var.xres, layer->info->var.yres);
+    mutex_unlock(&fbdev->flush_lock);
+    return 0;
+}
+
+static void pynqz1_fb_overlay_get_config(struct pynqz1_fb_layer* layer, struct pynqz1_fb_overlay_config* config)
+{
+    memset(config, 0, sizeof(*config));
+    config->x      = layer->x;
+    config->y      = layer->y;
+    config->zorder = layer->zorder;
+    config->alpha  = layer->alpha;
 }
 
 /**
- * Set the framebuffer hardware blank state.
+ * Show or hide an overlay.
  */
-static int pynqz1_fb_blank(int blank_mode, struct fb_info *fbi)
+static int pynqz1_fb_overlay_blank(int blank_mode, struct fb_info* info)
 {
-    // Nothing to do.
+    struct pynqz1_fb_layer* layer = info->par;
+    struct pynqz1_fb_device* fbdev = layer->fbdev;
+
+    mutex_lock(&fbdev->flush_lock);
+    layer->visible = blank_mode == FB_BLANK_UNBLANK;
+    pynqz1_fb_layer_damage(layer, 0, 0, info->var.xres, info->var.yres);
+    mutex_unlock(&fbdev->flush_lock);
     return 0;
 }
 
 /**
- * Set pseudo color palette.
+ * Handle driver specific ioctls.
  */
-static int pynqz1_fb_setcolreg(u_int regno, u_int red, u_int green, u_int blue, u_int transp, struct fb_info* info)
+static int pynqz1_fb_ioctl(struct fb_info* info, unsigned int cmd, unsigned long arg)
 {
-	u32 *palette = info->pseudo_palette;
-
-	if (regno >= PALETTE_ENTRIES_NO) {
-        return -EINVAL;
+    struct pynqz1_fb_layer* layer = info->par;
+    void __user* argp = (void __user*)arg;
+
+    switch(cmd) {
+    case PYNQZ1_FB_IOCTL_DAMAGE: {
+        struct pynqz1_fb_rect rect;
+        if( copy_from_user(&rect, argp, sizeof(rect)) ) {
+            return -EFAULT;
+        }
+        if( !(layer->fbdev->flags & PYNQZ1_FB_FLAGS_SHADOW) ) {
+            // Software draws into the scanout frame directly. Only the readback needs to know.
+            pynqz1_fb_readback_report(layer->fbdev, rect.x, rect.y, rect.width, rect.height);
+            return 0;
+        }
+        pynqz1_fb_layer_damage(layer, rect.x, rect.y, rect.width, rect.height);
+        return 0;
+    }
+    case PYNQZ1_FB_IOCTL_GET_OVERLAY: {
+        struct pynqz1_fb_overlay_config config;
+        if( layer == &layer->fbdev->primary ) {
+            return -EINVAL;
+        }
+        pynqz1_fb_overlay_get_config(layer, &config);
+        if( copy_to_user(argp, &config, sizeof(config)) ) {
+            return -EFAULT;
+        }
+        return 0;
+    }
+    case PYNQZ1_FB_IOCTL_SET_OVERLAY: {
+        struct pynqz1_fb_overlay_config config;
+        if( layer == &layer->fbdev->primary ) {
+            return -EINVAL;
+        }
+        if( copy_from_user(&config, argp, sizeof(config)) ) {
+            return -EFAULT;
+        }
+        return pynqz1_fb_overlay_configure(layer, &config);
+    }
+    case PYNQZ1_FB_IOCTL_PRESENT: {
+        struct pynqz1_fb_present request;
+        int rc;
+        if( layer != &layer->fbdev->primary ) {
+            return -EINVAL;
+        }
+        if( copy_from_user(&request, argp, sizeof(request)) ) {
+            return -EFAULT;
+        }
+        rc = pynqz1_fb_present(layer->fbdev, &request);
+        if( rc ) {
+            return rc;
+        }
+        if( copy_to_user(argp, &request, sizeof(request)) ) {
+            return -EFAULT;
+        }
+        return 0;
+    }
+    case PYNQZ1_FB_IOCTL_GET_PRESENT_STATUS: {
+        struct pynqz1_fb_device* fbdev = layer->fbdev;
+        struct pynqz1_fb_present_status status;
+        unsigned long flags;
+        spin_lock_irqsave(&fbdev->present_lock, flags);
+        status = fbdev->present_status;
+        spin_unlock_irqrestore(&fbdev->present_lock, flags);
+        if( copy_to_user(argp, &status, sizeof(status)) ) {
+            return -EFAULT;
+        }
+        return 0;
+    }
+    case PYNQZ1_FB_IOCTL_SET_PRESENT_MODE: {
+        struct pynqz1_fb_device* fbdev = layer->fbdev;
+        unsigned long flags;
+        u32 mode;
+        if( get_user(mode, (u32 __user*)argp) ) {
+            return -EFAULT;
+        }
+        if( mode != PYNQZ1_FB_PRESENT_MODE_FIFO && mode != PYNQZ1_FB_PRESENT_MODE_MAILBOX ) {
+            return -EINVAL;
+        }
+        spin_lock_irqsave(&fbdev->present_lock, flags);
+        fbdev->present_status.mode = mode;
+        spin_unlock_irqrestore(&fbdev->present_lock, flags);
+        return 0;
+    }
+    case FBIO_WAITFORVSYNC: {
+        u32 crtc;
+        if( get_user(crtc, (u32 __user*)argp) ) {
+            return -EFAULT;
+        }
+        return crtc == 0 ? pynqz1_fb_wait_for_vsync(layer->fbdev) : -ENODEV;
+    }
+    case PYNQZ1_FB_IOCTL_READ_TILES: {
+        struct pynqz1_fb_tile_read request;
+        int rc;
+        if( layer != &layer->fbdev->primary ) {
+            return -EINVAL;
+        }
+        if( copy_from_user(&request, argp, sizeof(request)) ) {
+            return -EFAULT;
+        }
+        rc = pynqz1_fb_read_tiles(layer->fbdev, &request);
+        if( rc ) {
+            return rc;
+        }
+        if( copy_to_user(argp, &request, sizeof(request)) ) {
+            return -EFAULT;
+        }
+        return 0;
+    }
+    default:
+        return -ENOTTY;
     }
-	
-	red >>= 8;
-	green >>= 8;
-	blue >>= 8;
-	palette[regno] = (red << RED_SHIFT) | (green << GREEN_SHIFT) | (blue << BLUE_SHIFT);
-
-	return 0;
 }
 
 /**
@@ -370,6 +1655,238 @@ static struct fb_ops pynqz1_fb_ops =
     .fb_fillrect	= cfb_fillrect,         // fill rectangle area (use default function in the kernel)
 	.fb_copyarea	= cfb_copyarea,         // copy rectangle area (use default function in the kernel)
 	.fb_imageblit	= cfb_imageblit,        // image block transfer (use default function in the kernel)
+    .fb_cursor      = pynqz1_fb_cursor,     // draw the cursor with save-under
+    .fb_mmap        = pynqz1_fb_mmap,       // map all frames
+    .fb_ioctl       = pynqz1_fb_ioctl,      // driver specific ioctls
+};
+
+/**
+ * Framebuffer operations used when software draws into the shadow surface.
+ */
+static struct fb_ops pynqz1_fb_shadow_ops =
+{
+	.owner			= THIS_MODULE,
+	.fb_blank		= pynqz1_fb_blank,              // set blank state
+	.fb_setcolreg   = pynqz1_fb_setcolreg,          // set pseudo color palette
+    .fb_read        = fb_sys_read,                  // read from system memory (use default function in the kernel)
+    .fb_write       = pynqz1_fb_shadow_write,       // write to system memory and damage the written lines
+    .fb_fillrect	= pynqz1_fb_shadow_fillrect,    // fill rectangle area and damage it
+	.fb_copyarea	= pynqz1_fb_shadow_copyarea,    // copy rectangle area and damage it
+	.fb_imageblit	= pynqz1_fb_shadow_imageblit,   // image block transfer and damage it
+    .fb_cursor      = pynqz1_fb_cursor,             // draw the cursor with save-under and damage it
+    .fb_mmap        = pynqz1_fb_shadow_mmap,        // map shadow surface with write tracking
+    .fb_ioctl       = pynqz1_fb_ioctl,              // driver specific ioctls
+};
+
+/**
+ * Framebuffer operations of overlays.
+ */
+static struct fb_ops pynqz1_fb_overlay_ops =
+{
+	.owner			= THIS_MODULE,
+	.fb_blank		= pynqz1_fb_overlay_blank,      // show or hide the overlay
+	.fb_setcolreg   = pynqz1_fb_setcolreg,          // set pseudo color palette
+    .fb_read        = fb_sys_read,                  // read from system memory (use default function in the kernel)
+    .fb_write       = pynqz1_fb_shadow_write,       // write to system memory and damage the written lines
+    .fb_fillrect	= pynqz1_fb_shadow_fillrect,    // fill rectangle area and damage it
+	.fb_copyarea	= pynqz1_fb_shadow_copyarea,    // copy rectangle area and damage it
+	.fb_imageblit	= pynqz1_fb_shadow_imageblit,   // image block transfer and damage it
+    .fb_mmap        = pynqz1_fb_shadow_mmap,        // map shadow surface with write tracking
+    .fb_ioctl       = pynqz1_fb_ioctl,              // driver specific ioctls
+};
+
+static ssize_t pynqz1_fb_overlay_show_position(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)dev_get_drvdata(dev))->par;
+    return sprintf(buf, "%d,%d\n", layer->x, layer->y);
+}
+
+static ssize_t pynqz1_fb_overlay_store_position(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)dev_get_drvdata(dev))->par;
+    struct pynqz1_fb_overlay_config config;
+    int rc;
+
+    pynqz1_fb_overlay_get_config(layer, &config);
+    if( sscanf(buf, "%d,%d", &config.x, &config.y) != 2 ) {
+        return -EINVAL;
+    }
+    rc = pynqz1_fb_overlay_configure(layer, &config);
+    return rc ? rc : count;
+}
+
+static ssize_t pynqz1_fb_overlay_show_zorder(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)dev_get_drvdata(dev))->par;
+    return sprintf(buf, "%u\n", layer->zorder);
+}
+
+static ssize_t pynqz1_fb_overlay_store_zorder(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)dev_get_drvdata(dev))->par;
+    struct pynqz1_fb_overlay_config config;
+    int rc;
+
+    pynqz1_fb_overlay_get_config(layer, &config);
+    rc = kstrtou32(buf, 0, &config.zorder);
+    if( rc ) {
+        return rc;
+    }
+    rc = pynqz1_fb_overlay_configure(layer, &config);
+    return rc ? rc : count;
+}
+
+static ssize_t pynqz1_fb_overlay_show_alpha(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)dev_get_drvdata(dev))->par;
+    return sprintf(buf, "%u\n", layer->alpha);
+}
+
+static ssize_t pynqz1_fb_overlay_store_alpha(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)dev_get_drvdata(dev))->par;
+    struct pynqz1_fb_overlay_config config;
+    int rc;
+
+    pynqz1_fb_overlay_get_config(layer, &config);
+    rc = kstrtou32(buf, 0, &config.alpha);
+    if( rc ) {
+        return rc;
+    }
+    rc = pynqz1_fb_overlay_configure(layer, &config);
+    return rc ? rc : count;
+}
+
+/**
+ * sysfs attributes of overlay framebuffer devices.
+ */
+static struct device_attribute pynqz1_fb_overlay_attrs[] = {
+    __ATTR(overlay_position, S_IRUGO | S_IWUSR, pynqz1_fb_overlay_show_position, pynqz1_fb_overlay_store_position),
+    __ATTR(overlay_zorder,   S_IRUGO | S_IWUSR, pynqz1_fb_overlay_show_zorder,   pynqz1_fb_overlay_store_zorder),
+    __ATTR(overlay_alpha,    S_IRUGO | S_IWUSR, pynqz1_fb_overlay_show_alpha,    pynqz1_fb_overlay_store_alpha),
+};
+
+/**
+ * Calculate the pixel clock of a screen in kHz.
+ * The dynamic clock generates the serial clock (5 times the pixel clock) from the 100MHz reference clock.
+ */
+static u32 pynqz1_fb_pixel_clock(const struct pynqz1_fb_screen_param* screen)
+{
+    const struct dynclk_param* dynclk = &screen->dynclk;
+    return 100000u*dynclk->multiplier/(dynclk->prescaler*dynclk->postscaler*5);
+}
+
+/**
+ * Calculate the memory bandwidth VDMA consumes to scan out a screen in kB/s.
+ * That is pixel clock x bytes per pixel, scaled by the fraction of the frame which is active.
+ */
+static u32 pynqz1_fb_bandwidth(const struct pynqz1_fb_screen_param* screen)
+{
+    u64 bandwidth = (u64)pynqz1_fb_pixel_clock(screen)*BYTES_PER_PIXEL*screen->width*screen->height;
+    return (u32)div_u64(bandwidth, screen->hFrameSize*screen->vFrameSize);
+}
+
+/**
+ * Find the screen with the most pixels whose scanout fits in the bandwidth budget.
+ * Returns NULL if no screen fits.
+ */
+static struct pynqz1_fb_screen_param* pynqz1_fb_find_screen_in_budget(u32 budget)
+{
+    struct pynqz1_fb_screen_param* screen_param;
+    struct pynqz1_fb_screen_param* found = NULL;
+
+    for(screen_param = pynqz1_fb_screen_params; screen_param->width != 0; ++screen_param ) {
+        if( pynqz1_fb_bandwidth(screen_param) > budget ) {
+            continue;
+        }
+        if( found == NULL || screen_param->width*screen_param->height > found->width*found->height ) {
+            found = screen_param;
+        }
+    }
+    return found;
+}
+
+static ssize_t pynqz1_fb_show_bandwidth(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)dev_get_drvdata(dev))->par;
+    return sprintf(buf, "%u\n", pynqz1_fb_bandwidth(layer->fbdev->screen_param));
+}
+
+static ssize_t pynqz1_fb_show_bandwidth_budget(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)dev_get_drvdata(dev))->par;
+    return sprintf(buf, "%u\n", layer->fbdev->bandwidth_budget);
+}
+
+static ssize_t pynqz1_fb_store_bandwidth_budget(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)dev_get_drvdata(dev))->par;
+    struct pynqz1_fb_device* fbdev = layer->fbdev;
+    u32 budget;
+    int rc;
+
+    rc = kstrtou32(buf, 0, &budget);
+    if( rc ) {
+        return rc;
+    }
+    // The screen can not be changed while it is registered, so reject a budget which the current screen exceeds.
+    if( budget != 0 && pynqz1_fb_bandwidth(fbdev->screen_param) > budget ) {
+        return -EBUSY;
+    }
+    fbdev->bandwidth_budget = budget;
+    return count;
+}
+
+static ssize_t pynqz1_fb_show_bandwidth_headroom(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)dev_get_drvdata(dev))->par;
+    struct pynqz1_fb_device* fbdev = layer->fbdev;
+    u32 budget = fbdev->bandwidth_budget;
+
+    if( budget == 0 ) {
+        return sprintf(buf, "unlimited\n");
+    }
+    return sprintf(buf, "%u\n", budget - pynqz1_fb_bandwidth(fbdev->screen_param));
+}
+
+static ssize_t pynqz1_fb_show_bandwidth_modes(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)dev_get_drvdata(dev))->par;
+    u32 budget = layer->fbdev->bandwidth_budget;
+    const struct pynqz1_fb_screen_param* screen_param;
+    ssize_t length = 0;
+
+    for(screen_param = pynqz1_fb_screen_params; screen_param->width != 0; ++screen_param ) {
+        u32 bandwidth = pynqz1_fb_bandwidth(screen_param);
+        length += scnprintf(buf + length, PAGE_SIZE - length, "%ux%u %u %s\n",
+                            screen_param->width, screen_param->height, bandwidth,
+                            budget == 0 || bandwidth <= budget ? "ok" : "over");
+    }
+    return length;
+}
+
+static ssize_t pynqz1_fb_show_cma_usage(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)dev_get_drvdata(dev))->par;
+    return sprintf(buf, "%u\n", layer->fbdev->cma_usage);
+}
+
+static ssize_t pynqz1_fb_show_cma_peak(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct pynqz1_fb_layer* layer = ((struct fb_info*)dev_get_drvdata(dev))->par;
+    return sprintf(buf, "%u\n", layer->fbdev->cma_peak);
+}
+
+/**
+ * sysfs attributes of the primary framebuffer device. Bandwidths are in kB/s, and CMA usages are in bytes.
+ */
+static struct device_attribute pynqz1_fb_attrs[] = {
+    __ATTR(cma_usage,          S_IRUGO,           pynqz1_fb_show_cma_usage,          NULL),
+    __ATTR(cma_peak,           S_IRUGO,           pynqz1_fb_show_cma_peak,           NULL),
+    __ATTR(bandwidth,          S_IRUGO,           pynqz1_fb_show_bandwidth,          NULL),
+    __ATTR(bandwidth_budget,   S_IRUGO | S_IWUSR, pynqz1_fb_show_bandwidth_budget,   pynqz1_fb_store_bandwidth_budget),
+    __ATTR(bandwidth_headroom, S_IRUGO,           pynqz1_fb_show_bandwidth_headroom, NULL),
+    __ATTR(bandwidth_modes,    S_IRUGO,           pynqz1_fb_show_bandwidth_modes,    NULL),
 };
 
 /**
@@ -409,31 +1926,165 @@ static int pynqz1_fb_parse_dt(struct platform_device* pdev, struct pynqz1_fb_dev
     }
     fbdev->screen_param = screen_param;
 
+    fbdev->bandwidth_budget = 0;
+    of_property_read_u32(np, "bandwidth-budget", &fbdev->bandwidth_budget);
+    if( fbdev->bandwidth_budget != 0 ) {
+        u32 bandwidth = pynqz1_fb_bandwidth(screen_param);
+        if( bandwidth > fbdev->bandwidth_budget ) {
+            dev_info(&pdev->dev, "Scanout of %dx%d requires %u kB/s, which exceeds the budget %u kB/s.\n", fbdev->width, fbdev->height, bandwidth, fbdev->bandwidth_budget);
+            screen_param = pynqz1_fb_find_screen_in_budget(fbdev->bandwidth_budget);
+            if( screen_param == NULL ) {
+                dev_err(&pdev->dev, "No resolution fits in the bandwidth budget.\n");
+                return -EINVAL;
+            }
+            fbdev->width  = screen_param->width;
+            fbdev->height = screen_param->height;
+            fbdev->screen_param = screen_param;
+            dev_info(&pdev->dev, "Fall back to %dx%d.\n", fbdev->width, fbdev->height);
+        }
+    }
+    dev_info(&pdev->dev, "Scanout bandwidth is %u kB/s.\n", pynqz1_fb_bandwidth(fbdev->screen_param));
+
     ret = of_property_read_u32(np, "debug", &fbdev->debug);
 
+    fbdev->rotate = 0;
+    of_property_read_u32(np, "rotate", &fbdev->rotate);
+    if( fbdev->rotate != 0 && fbdev->rotate != 90 && fbdev->rotate != 180 && fbdev->rotate != 270 ) {
+        dev_info(&pdev->dev, "Requested rotation %d is not supported. Fall back to 0.\n", fbdev->rotate);
+        fbdev->rotate = 0;
+    }
+    if( fbdev->rotate != 0 ) {
+        dev_info(&pdev->dev, "Rotate the screen by %d degrees.\n", fbdev->rotate);
+        fbdev->flags |= PYNQZ1_FB_FLAGS_SHADOW;
+    }
+
+    fbdev->scale = 1;
+    of_property_read_u32(np, "scale", &fbdev->scale);
+    if( fbdev->scale < 1 || fbdev->scale > 3 ) {
+        dev_info(&pdev->dev, "Requested scale %d is not supported. Fall back to 1.\n", fbdev->scale);
+        fbdev->scale = 1;
+    }
+    if( fbdev->scale > 1 && fbdev->rotate != 0 ) {
+        dev_info(&pdev->dev, "Scaling a rotated screen is not supported. Fall back to scale 1.\n");
+        fbdev->scale = 1;
+    }
+    if( fbdev->scale > 1 ) {
+        dev_info(&pdev->dev, "Magnify the screen by %d.\n", fbdev->scale);
+        fbdev->flags |= PYNQZ1_FB_FLAGS_SHADOW;
+    }
+
+    fbdev->number_of_overlays = 0;
+    of_property_read_u32(np, "overlays", &fbdev->number_of_overlays);
+    if( fbdev->number_of_overlays > MAX_OVERLAYS ) {
+        dev_info(&pdev->dev, "Requested %d overlays. Fall back to %d.\n", fbdev->number_of_overlays, MAX_OVERLAYS);
+        fbdev->number_of_overlays = MAX_OVERLAYS;
+    }
+    if( fbdev->number_of_overlays > 0 ) {
+        dev_info(&pdev->dev, "Create %d overlays.\n", fbdev->number_of_overlays);
+        fbdev->flags |= PYNQZ1_FB_FLAGS_SHADOW;
+    }
+
+    fbdev->bits_per_pixel = BITS_PER_PIXEL;
+    of_property_read_u32(np, "bits-per-pixel", &fbdev->bits_per_pixel);
+    if( fbdev->bits_per_pixel != BITS_PER_PIXEL && fbdev->bits_per_pixel != 8 ) {
+        dev_info(&pdev->dev, "Requested %d bits per pixel is not supported. Fall back to %d.\n", fbdev->bits_per_pixel, BITS_PER_PIXEL);
+        fbdev->bits_per_pixel = BITS_PER_PIXEL;
+    }
+    if( fbdev->bits_per_pixel == 8 && (fbdev->rotate != 0 || fbdev->scale > 1 || fbdev->number_of_overlays > 0) ) {
+        dev_info(&pdev->dev, "8 bits per pixel with rotate, scale or overlays is not supported. Fall back to %d.\n", BITS_PER_PIXEL);
+        fbdev->bits_per_pixel = BITS_PER_PIXEL;
+    }
+    if( fbdev->bits_per_pixel == 8 ) {
+        dev_info(&pdev->dev, "Draw into a palettized 8bpp surface.\n");
+        fbdev->flags |= PYNQZ1_FB_FLAGS_SHADOW;
+    }
+
+    fbdev->number_of_frames = 1;
+    of_property_read_u32(np, "frames", &fbdev->number_of_frames);
+    if( fbdev->number_of_frames < 1 || fbdev->number_of_frames > FB_MAX_NUMBER_OF_FRAMES ) {
+        dev_info(&pdev->dev, "Requested %d frames. Fall back to 1.\n", fbdev->number_of_frames);
+        fbdev->number_of_frames = 1;
+    }
+    if( fbdev->number_of_frames > 2 && (fbdev->flags & PYNQZ1_FB_FLAGS_SHADOW) ) {
+        dev_info(&pdev->dev, "The shadow surface is double buffered with at most 2 frames. Fall back to 2.\n");
+        fbdev->number_of_frames = 2;
+    }
+
     return 0;
 }
 
-// Calculate page aligned framebuffer size.
-#define GET_FB_SIZE(fbdev) PAGE_ALIGN((fbdev)->width * (fbdev)->height * BYTES_PER_PIXEL)
 // Release register resource.
 #define RELEASE_REG_RESOURCE(fbdev, resource) \
     do { if( (fbdev)->reg_##resource != NULL ) { devm_release_resource((fbdev)->dev, fbdev->reg_##resource ); fbdev->reg_##resource = NULL; } } while(0)
 
+/**
+ * Allocate the shadow surface of a layer.
+ */
+static int pynqz1_fb_layer_alloc(struct pynqz1_fb_layer* layer, u32 size)
+{
+    layer->shadow_size = PAGE_ALIGN(size);
+    layer->shadow = vmalloc_user(layer->shadow_size);   // Zeroed by vmalloc_user
+    layer->dirty_pages = kcalloc(BITS_TO_LONGS(layer->shadow_size >> PAGE_SHIFT), sizeof(unsigned long), GFP_KERNEL);
+    if( !layer->shadow || !layer->dirty_pages ) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ * Release the shadow surface of a layer.
+ */
+static void pynqz1_fb_layer_free(struct pynqz1_fb_layer* layer)
+{
+    if( layer->shadow != NULL ) {
+        unsigned long offset;
+        // Detach pages from the device file mapping they were associated with on fault.
+        for(offset = 0; offset < layer->shadow_size; offset += PAGE_SIZE) {
+            vmalloc_to_page(layer->shadow + offset)->mapping = NULL;
+        }
+        vfree(layer->shadow);
+        layer->shadow = NULL;
+    }
+    kfree(layer->dirty_pages);
+    layer->dirty_pages = NULL;
+}
+
 /**
  * Release framebuffer hardware resources.
  */
 static void pynqz1_fb_release(struct pynqz1_fb_device* fbdev)
 {
-    int i;
+    int i, j;
 
     if( fbdev == NULL ) return;
 
+    // Unregister overlay framebuffer devices
+    for(i = 0; i < MAX_OVERLAYS; i++) {
+        struct pynqz1_fb_layer* layer = fbdev->overlays[i];
+        if( layer != NULL && layer->registered ) {
+            for(j = 0; j < ARRAY_SIZE(pynqz1_fb_overlay_attrs); j++) {
+                device_remove_file(layer->info->dev, &pynqz1_fb_overlay_attrs[j]);
+            }
+            unregister_framebuffer(layer->info);
+            layer->registered = 0;
+        }
+    }
     // Unregister framebuffer device
     if( fbdev->flags & PYNQZ1_FB_FLAGS_REGISTERED ) {
+        for(i = 0; i < ARRAY_SIZE(pynqz1_fb_attrs); i++) {
+            device_remove_file(fbdev->info.dev, &pynqz1_fb_attrs[i]);
+        }
         unregister_framebuffer(&fbdev->info);
         fbdev->flags &= ~PYNQZ1_FB_FLAGS_REGISTERED;
     }
+    // Stop the interrupt and the work which it schedules
+    if( fbdev->irq > 0 ) {
+        vtc_write_reg(fbdev, VTC_REG_IER, 0);
+        devm_free_irq(fbdev->dev, fbdev->irq, fbdev);
+        fbdev->irq = 0;
+    }
+    cancel_delayed_work_sync(&fbdev->flush_work);
+    cancel_delayed_work_sync(&fbdev->release_work);
 
     // Stop modules
     if( fbdev->reg_vdma != NULL ) {
@@ -456,12 +2107,89 @@ static void pynqz1_fb_release(struct pynqz1_fb_device* fbdev)
     RELEASE_REG_RESOURCE(fbdev, vdma);
     
     // Release framebuffer memories.
-    for(i = 0; i < FB_NUMBER_OF_FRAMES; i++) {
-        if( fbdev->frame[i].virt != NULL ) {
-            dma_free_coherent(fbdev->dev, GET_FB_SIZE(fbdev), fbdev->frame[i].virt, fbdev->frame[i].phys );
-            fbdev->frame[i].virt = NULL;
+    for(i = 0; i < FB_MAX_NUMBER_OF_FRAMES; i++) {
+        pynqz1_fb_frame_free(fbdev, i);
+    }
+
+    // Release overlays and shadow surfaces.
+    for(i = 0; i < MAX_OVERLAYS; i++) {
+        struct pynqz1_fb_layer* layer = fbdev->overlays[i];
+        if( layer != NULL ) {
+            pynqz1_fb_layer_free(layer);
+            framebuffer_release(layer->info);
+            fbdev->overlays[i] = NULL;
+        }
+    }
+    pynqz1_fb_layer_free(&fbdev->primary);
+    fb_dealloc_cmap(&fbdev->info.cmap);
+    vfree(fbdev->compose);
+    fbdev->compose = NULL;
+    kfree(fbdev->line_buffer);
+    fbdev->line_buffer = NULL;
+    kfree(fbdev->readback_dirty);
+    fbdev->readback_dirty = NULL;
+    kfree(fbdev->readback_hashes);
+    fbdev->readback_hashes = NULL;
+}
+
+/**
+ * Create and register an overlay framebuffer device.
+ * The overlay has the same size as the primary surface and A8R8G8B8 pixels.
+ */
+static int pynqz1_fb_overlay_create(struct pynqz1_fb_device* fbdev, u32 index)
+{
+    struct fb_info* info;
+    struct pynqz1_fb_layer* layer;
+    int rc;
+    int i;
+
+    info = framebuffer_alloc(sizeof(*layer), fbdev->dev);
+    if( !info ) {
+        return -ENOMEM;
+    }
+    layer = info->par;
+    layer->info    = info;
+    layer->fbdev   = fbdev;
+    layer->zorder  = index;
+    layer->alpha   = 255;
+    layer->visible = 1;
+    fbdev->overlays[index] = layer;     // Released by pynqz1_fb_release from here.
+
+    info->device = fbdev->dev;
+    info->pseudo_palette = layer->pseudo_palette;
+    info->fbops = &pynqz1_fb_overlay_ops;
+    info->flags = FBINFO_DEFAULT | FBINFO_VIRTFB;
+    info->fix = pynqz1_fb_fix;
+    strlcpy(info->fix.id, "PYNQ-Z1 OVL", sizeof(info->fix.id));
+    info->var = fbdev->info.var;        // Same geometry as the primary surface.
+    info->var.bits_per_pixel = OVERLAY_BYTES_PER_PIXEL*8;
+    info->var.transp.offset = 24;
+    info->var.transp.length = 8;
+    info->fix.line_length = info->var.xres*OVERLAY_BYTES_PER_PIXEL;
+
+    rc = pynqz1_fb_layer_alloc(layer, info->fix.line_length*info->var.yres);
+    if( rc ) {
+        return rc;
+    }
+    info->screen_base = (char __iomem*)layer->shadow;
+    info->screen_size = layer->shadow_size;
+    info->fix.smem_len = layer->shadow_size;
+
+    rc = register_framebuffer(info);
+    if( rc ) {
+        return rc;
+    }
+    mutex_lock(&fbdev->flush_lock);
+    layer->registered = 1;  // Composed from here.
+    mutex_unlock(&fbdev->flush_lock);
+
+    for(i = 0; i < ARRAY_SIZE(pynqz1_fb_overlay_attrs); i++) {
+        if( device_create_file(info->dev, &pynqz1_fb_overlay_attrs[i]) ) {
+            dev_warn(fbdev->dev, "Failed to create sysfs attribute %s\n", pynqz1_fb_overlay_attrs[i].attr.name);
         }
     }
+    dev_info(fbdev->dev, "Overlay %d registered as fb%d.\n", index, info->node);
+    return 0;
 }
 
 // Release resources and exit from the function if the return code indicates an error.
@@ -485,6 +2213,16 @@ static int pynqz1_fb_probe(struct platform_device *pdev)
     }
     memset(fbdev, 0, sizeof(*fbdev));
     fbdev->dev = &pdev->dev;
+    spin_lock_init(&fbdev->damage_lock);
+    mutex_init(&fbdev->flush_lock);
+    INIT_DELAYED_WORK(&fbdev->flush_work, pynqz1_fb_flush);
+    mutex_init(&fbdev->frame_lock);
+    INIT_DELAYED_WORK(&fbdev->release_work, pynqz1_fb_release_frames);
+    init_waitqueue_head(&fbdev->vblank_wait);
+    spin_lock_init(&fbdev->present_lock);
+    fbdev->primary.info  = &fbdev->info;
+    fbdev->primary.fbdev = fbdev;
+    fbdev->info.par = &fbdev->primary;
 	/* Store driver-specific data */
     platform_set_drvdata(pdev, fbdev);
 
@@ -523,16 +2261,12 @@ static int pynqz1_fb_probe(struct platform_device *pdev)
     
     /* Allocate framebuffer */
     {
-        int i;
-        for(i = 0; i < FB_NUMBER_OF_FRAMES; i++) {
-			void* virt;
-            virt = dma_alloc_coherent(fbdev->dev, fbsize, &fbdev->frame[i].phys, GFP_KERNEL);
-			if( !virt ) {
-				dev_err(&pdev->dev, "Failed to allocate frame buffer\n");
-				return -ENOMEM;
-			}
-            memset_io((void __iomem *)virt, 0, fbsize); // Clear
-			fbdev->frame[i].virt = virt;
+        // Only the scanout frame is allocated here. Back buffers are allocated on first use.
+        mutex_lock(&fbdev->frame_lock);
+        rc = pynqz1_fb_frame_alloc(fbdev, 0);
+        mutex_unlock(&fbdev->frame_lock);
+        if( rc ) {
+            RELEASE_AND_RETURN(rc);
         }
     }
     
@@ -542,10 +2276,11 @@ static int pynqz1_fb_probe(struct platform_device *pdev)
     fbdev->info.device = fbdev->dev;                                
     fbdev->info.pseudo_palette = fbdev->pseudo_palette;             // Pseudo color palette which is used to render console characters.
     fbdev->info.screen_base = (void __iomem*)fbdev->frame[0].virt;  // Virtual base address of frame buffer
+    fbdev->info.screen_size = fbsize;                               // read()/write() access frame 0 only.
     fbdev->info.fbops = &pynqz1_fb_ops;                             // function pointers which implements FB operations.
     fbdev->info.fix = pynqz1_fb_fix;                                // Fixed (Constant) framebuffer parameters.
 	fbdev->info.fix.smem_start = fbdev->frame[0].phys;              // Physical address of frame buffer.
-	fbdev->info.fix.smem_len = fbsize;                              // Length in bytes of the frame buffer.
+	fbdev->info.fix.smem_len = fbsize;                              // Length in bytes of the frame buffer. The other frames are not contiguous, and are only reachable by mmap.
 	fbdev->info.fix.line_length = fbdev->stride;                    // Bytes per line (stride) of frame buffer lines.
 	
     fbdev->info.var = pynqz1_fb_var;                                // Variable (changeable by request) parameters.
@@ -556,6 +2291,72 @@ static int pynqz1_fb_probe(struct platform_device *pdev)
     fbdev->info.var.width  = (u32)(fbdev->info.var.xres*5/96/2);    // Physical screen width in millimeters
     fbdev->info.var.height = (u32)(fbdev->info.var.yres*5/96/2);    // Physical screen height in millimeters
 
+    /* Allocate readback tile tracking. All tiles are reported by the first read. */
+    fbdev->readback_columns = DIV_ROUND_UP(fbdev->width, READBACK_TILE_SIZE);
+    fbdev->readback_rows    = DIV_ROUND_UP(fbdev->height, READBACK_TILE_SIZE);
+    fbdev->readback_dirty   = kcalloc(BITS_TO_LONGS(fbdev->readback_columns*fbdev->readback_rows), sizeof(unsigned long), GFP_KERNEL);
+    if( !fbdev->readback_dirty ) {
+        RELEASE_AND_RETURN(-ENOMEM);
+    }
+    bitmap_fill(fbdev->readback_dirty, fbdev->readback_columns*fbdev->readback_rows);
+    if( !(fbdev->flags & PYNQZ1_FB_FLAGS_SHADOW) ) {
+        // Changes made directly in the scanout frame which are not reported can be found only by hashing the tiles.
+        // The line buffer holds a line of a tile. With the shadow surface, it is allocated below.
+        fbdev->readback_hashes = kcalloc(fbdev->readback_columns*fbdev->readback_rows, sizeof(u32), GFP_KERNEL);
+        fbdev->line_buffer     = kmalloc(READBACK_TILE_SIZE*BYTES_PER_PIXEL, GFP_KERNEL);
+        if( !fbdev->readback_hashes || !fbdev->line_buffer ) {
+            RELEASE_AND_RETURN(-ENOMEM);
+        }
+    }
+
+    /* Allocate the shadow surface if software does not draw into the scanout frame directly */
+    if( fbdev->flags & PYNQZ1_FB_FLAGS_SHADOW ) {
+        struct fb_var_screeninfo* var = &fbdev->info.var;
+        if( fbdev->rotate == 90 || fbdev->rotate == 270 ) {
+            swap(var->xres, var->yres);
+            swap(var->width, var->height);
+        }
+        // The remainder of the output which the magnified surface does not cover stays black.
+        var->xres /= fbdev->scale;
+        var->yres /= fbdev->scale;
+        var->xres_virtual = var->xres;
+        var->yres_virtual = var->yres;
+        fbdev->info.fix.line_length = var->xres*BYTES_PER_PIXEL;
+        if( fbdev->bits_per_pixel == 8 ) {
+            var->bits_per_pixel = 8;
+            var->red.offset = var->green.offset = var->blue.offset = 0;
+            fbdev->info.fix.visual = FB_VISUAL_PSEUDOCOLOR;
+            fbdev->info.fix.line_length = var->xres;
+            if( fb_alloc_cmap(&fbdev->info.cmap, PALETTE_8BPP_ENTRIES, 0) ) {
+                dev_err(&pdev->dev, "Failed to allocate color map\n");
+                RELEASE_AND_RETURN(-ENOMEM);
+            }
+            // Start with the default color map. (fb_set_cmap is not used here, as the surface to damage is not allocated yet.)
+            {
+                const struct fb_cmap* cmap = &fbdev->info.cmap;
+                u32 i;
+                for(i = 0; i < PALETTE_8BPP_ENTRIES; i++) {
+                    fbdev->palette[i] = ((cmap->red[i] >> 8) << RED_SHIFT) | ((cmap->green[i] >> 8) << GREEN_SHIFT) | ((cmap->blue[i] >> 8) << BLUE_SHIFT);
+                }
+            }
+        }
+        rc = pynqz1_fb_layer_alloc(&fbdev->primary, fbdev->info.fix.line_length*var->yres);
+        fbdev->line_buffer = kmalloc(max_t(u32, fbdev->stride, PYNQZ1_BLIT_ROTATE_WORK_SIZE), GFP_KERNEL);
+        if( fbdev->number_of_overlays > 0 ) {
+            fbdev->compose = vmalloc(fbdev->primary.shadow_size);
+        }
+        if( rc || !fbdev->line_buffer || (fbdev->number_of_overlays > 0 && !fbdev->compose) ) {
+            dev_err(&pdev->dev, "Failed to allocate shadow surface\n");
+            RELEASE_AND_RETURN(-ENOMEM);
+        }
+        fbdev->info.flags |= FBINFO_VIRTFB;
+        fbdev->info.screen_base = (char __iomem*)fbdev->primary.shadow; // Software draws into the shadow surface.
+        fbdev->info.screen_size = fbdev->primary.shadow_size;
+        fbdev->info.fbops = &pynqz1_fb_shadow_ops;
+        fbdev->info.fix.smem_start = 0;                                 // Not physically contiguous. mmap is handled by the driver.
+        fbdev->info.fix.smem_len = fbdev->primary.shadow_size;
+    }
+
     /* Enable dynamically generated clock */
     dynclk_write_reg(fbdev, OFST_DISPLAY_CTRL, 0);
     mdelay(1);
@@ -651,6 +2452,28 @@ static int pynqz1_fb_probe(struct platform_device *pdev)
     }
     dev_info(&pdev->dev, "VTC configured.\n");
 
+    /* Enable the VTC vertical blanking interrupt if it is connected */
+    fbdev->irq = platform_get_irq(pdev, 0);
+    if( fbdev->irq > 0 ) {
+        rc = devm_request_irq(fbdev->dev, fbdev->irq, pynqz1_fb_vtc_irq, 0, DRIVER_NAME, fbdev);
+        if( rc ) {
+            dev_info(&pdev->dev, "Failed to request VTC interrupt %d. Use timer instead.\n", fbdev->irq);
+            fbdev->irq = 0;
+        }
+        else {
+            vtc_write_reg(fbdev, VTC_REG_ISR, VTC_IXR_G_VBLANK_MASK);
+            vtc_write_reg(fbdev, VTC_REG_IER, VTC_IXR_G_VBLANK_MASK);
+            dev_info(&pdev->dev, "VTC interrupt : %d\n", fbdev->irq);
+        }
+    }
+    else {
+        fbdev->irq = 0;
+    }
+    if( fbdev->irq == 0 && fbdev->number_of_frames > 1 && (fbdev->flags & PYNQZ1_FB_FLAGS_SHADOW) ) {
+        dev_info(&pdev->dev, "Double buffering of the shadow surface requires the VTC interrupt. Fall back to 1 frame.\n");
+        fbdev->number_of_frames = 1;
+    }
+
     /* Initialize VDMA */
     {
         u32 cr = 0;
@@ -665,9 +2488,10 @@ static int pynqz1_fb_probe(struct platform_device *pdev)
         vdma_write_reg(fbdev, VDMA_REG_MM2S_ADDR+VDMA_REG_HSIZE, fbdev->width*BYTES_PER_PIXEL);
         vdma_write_reg(fbdev, VDMA_REG_MM2S_ADDR+VDMA_REG_STRD_FRMDLY, fbdev->stride | (0 << VDMA_FRMDLY_SHIFT));    // FrameDelay = 0;
 
-        for(i = 0; i < FB_NUMBER_OF_FRAMES; i++) {
+        // Back buffers not allocated yet also read frame 0 until they are allocated.
+        for(i = 0; i < fbdev->number_of_frames; i++) {
             u32 reg = VDMA_REG_MM2S_ADDR+VDMA_REG_START_ADDR+i*VDMA_START_ADDR_LEN;
-            vdma_write_reg(fbdev, reg, fbdev->frame[i].phys);
+            vdma_write_reg(fbdev, reg, fbdev->frame[fbdev->frame[i].virt != NULL ? i : 0].phys);
         }
 
         // Start VDMA TX channel
@@ -687,6 +2511,16 @@ static int pynqz1_fb_probe(struct platform_device *pdev)
     }
     dev_info(&pdev->dev, "VDMA configured.\n");
 
+    /* Allocate the frame into which the shadow surface is written while frame 0 is shown */
+    if( (fbdev->flags & PYNQZ1_FB_FLAGS_SHADOW) && fbdev->number_of_frames > 1 ) {
+        mutex_lock(&fbdev->frame_lock);
+        rc = pynqz1_fb_frame_alloc(fbdev, 1);
+        mutex_unlock(&fbdev->frame_lock);
+        if( rc ) {
+            RELEASE_AND_RETURN(rc);
+        }
+    }
+
     /* register framebuffer */
     rc = register_framebuffer(&fbdev->info);
     if( rc ) {
@@ -695,6 +2529,27 @@ static int pynqz1_fb_probe(struct platform_device *pdev)
     }
 
     fbdev->flags |= PYNQZ1_FB_FLAGS_REGISTERED;
+
+    {
+        u32 i;
+        for(i = 0; i < ARRAY_SIZE(pynqz1_fb_attrs); i++) {
+            if( device_create_file(fbdev->info.dev, &pynqz1_fb_attrs[i]) ) {
+                dev_warn(&pdev->dev, "Failed to create sysfs attribute %s\n", pynqz1_fb_attrs[i].attr.name);
+            }
+        }
+    }
+
+    /* create overlays */
+    {
+        u32 i;
+        for(i = 0; i < fbdev->number_of_overlays; i++) {
+            rc = pynqz1_fb_overlay_create(fbdev, i);
+            if( rc ) {
+                dev_err(&pdev->dev, "Could not create overlay %d\n", i);
+                RELEASE_AND_RETURN(rc);
+            }
+        }
+    }
     dev_info(&pdev->dev, "PYNQ-Z1 Framebuffer Probed.\n");
 
     return 0;
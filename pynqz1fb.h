@@ -59,6 +59,8 @@
 #define VTC_CTL_HFSS_MASK	0x00000200
 #define VTC_CTL_HTSS_MASK	0x00000100
 
+#define VTC_IXR_G_VBLANK_MASK	0x00001000
+
 #define VTC_CTL_ALLSS_MASK	0x03F5EF00 
 #define VTC_CTL_SE_MASK	0x00000020
 #define VTC_CTL_DE_MASK	0x00000008
@@ -119,6 +121,7 @@
 #define VDMA_PARKPTR_READREF_MASK 0x0000001F
 #define VDMA_PARKPTR_WRTREF_MASK  0x00001F00
 #define VDMA_PARKPTR_READSTR_MASK 0x001F0000
+#define VDMA_PARKPTR_READSTR_SHIFT 16
 #define VDMA_PARKPTR_WRTSTR_MASK  0x1F000000
 
 #define VDMA_FRMDLY_SHIFT     24
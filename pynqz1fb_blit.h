@@ -0,0 +1,316 @@
+/**
+ * @file pynqz1fb_blit.h
+ * @author Kenta IDA <fuga@fugafuga.org>
+ * @description
+ * Pixel conversion kernels which write a cached drawing surface to the scanout frame.
+ * These functions depend only on the fixed width integer types,
+ * so that the same code can be built on the host for benchmarking.
+ */
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+// Bytes per pixel of both the drawing surface and the scanout frame.
+#define PYNQZ1_BLIT_BPP     3
+// Edge length in pixels of the square tiles processed by the rotation kernel.
+// A tile of 32x32 pixels (3KiB) fits in the L1 data cache of Cortex-A9.
+#define PYNQZ1_BLIT_TILE    32
+// Size in bytes of the work buffer passed to the rotation kernels. (a tile followed by a line segment)
+// It is too large for the kernel stack, so the caller allocates it.
+#define PYNQZ1_BLIT_ROTATE_WORK_SIZE ((PYNQZ1_BLIT_TILE*PYNQZ1_BLIT_TILE + PYNQZ1_BLIT_TILE)*PYNQZ1_BLIT_BPP)
+
+/**
+ * Copy a rectangle without any conversion.
+ * (x, y) is the position of the rectangle both in the source and the destination.
+ */
+static inline void pynqz1_blit_copy(u8* dst, u32 dst_stride, const u8* src, u32 src_stride,
+                                    u32 x, u32 y, u32 width, u32 height)
+{
+    const u8* s = src + y*src_stride + x*PYNQZ1_BLIT_BPP;
+    u8* d = dst + y*dst_stride + x*PYNQZ1_BLIT_BPP;
+    u32 row;
+
+    for(row = 0; row < height; row++, s += src_stride, d += dst_stride) {
+        memcpy(d, s, width*PYNQZ1_BLIT_BPP);
+    }
+}
+
+/**
+ * Copy a pixel.
+ */
+static inline void pynqz1_blit_pixel(u8* d, const u8* s)
+{
+    d[0] = s[0];
+    d[1] = s[1];
+    d[2] = s[2];
+}
+
+/**
+ * Write a rectangle of the source surface to the destination frame, rotating it clockwise by 180 degrees.
+ * The destination is written in ascending address order. Each output line segment is assembled
+ * in line (PYNQZ1_BLIT_TILE pixels) on the cached side and written to the (uncached) destination with a single memcpy.
+ */
+static inline void pynqz1_blit_rotate180(u8* dst, u32 dst_stride, const u8* src, u32 src_stride,
+                                         u32 src_width, u32 src_height, u8* line,
+                                         u32 x, u32 y, u32 width, u32 height)
+{
+    u32 dy;
+
+    for(dy = src_height - y - height; dy < src_height - y; dy++) {
+        const u8* s = src + (src_height - 1 - dy)*src_stride;
+        u8* d = dst + dy*dst_stride;
+        u32 dx;
+
+        for(dx = src_width - x - width; dx < src_width - x; dx += PYNQZ1_BLIT_TILE) {
+            u32 n = src_width - x - dx < PYNQZ1_BLIT_TILE ? src_width - x - dx : PYNQZ1_BLIT_TILE;
+            u32 i;
+            for(i = 0; i < n; i++) {
+                pynqz1_blit_pixel(line + i*PYNQZ1_BLIT_BPP, s + (src_width - 1 - dx - i)*PYNQZ1_BLIT_BPP);
+            }
+            memcpy(d + dx*PYNQZ1_BLIT_BPP, line, n*PYNQZ1_BLIT_BPP);
+        }
+    }
+}
+
+/**
+ * Write a rectangle of the source surface to the destination frame, transposing it.
+ * If clockwise is non-zero, source pixel (sx, sy) goes to (src_height-1-sy, sx),
+ * otherwise it goes to (sy, src_width-1-sx).
+ * The destination is processed in PYNQZ1_BLIT_TILE x PYNQZ1_BLIT_TILE tiles in raster order.
+ * The source rows of each tile are first copied into the tile buffer at the head of work, so that the column-wise
+ * reads hit the L1 cache while the destination is written line by line in ascending address order.
+ * work must be PYNQZ1_BLIT_ROTATE_WORK_SIZE bytes.
+ */
+static inline void pynqz1_blit_transpose(u8* dst, u32 dst_stride, const u8* src, u32 src_stride,
+                                         u32 src_width, u32 src_height, int clockwise, u8* work,
+                                         u32 x, u32 y, u32 width, u32 height)
+{
+    const u32 tile_stride = PYNQZ1_BLIT_TILE*PYNQZ1_BLIT_BPP;
+    u8* tile = work;
+    u8* line = work + PYNQZ1_BLIT_TILE*tile_stride;
+    // Destination rectangle.
+    u32 dx1 = clockwise ? src_height - y - height : y;
+    u32 dy1 = clockwise ? x : src_width - x - width;
+    u32 dx2 = dx1 + height;
+    u32 dy2 = dy1 + width;
+    u32 dty;
+
+    for(dty = dy1; dty < dy2; dty += PYNQZ1_BLIT_TILE) {
+        u32 dth = dy2 - dty < PYNQZ1_BLIT_TILE ? dy2 - dty : PYNQZ1_BLIT_TILE;
+        u32 dtx;
+
+        for(dtx = dx1; dtx < dx2; dtx += PYNQZ1_BLIT_TILE) {
+            u32 dtw = dx2 - dtx < PYNQZ1_BLIT_TILE ? dx2 - dtx : PYNQZ1_BLIT_TILE;
+            // Source tile which is dth pixels wide and dtw pixels high.
+            u32 tx = clockwise ? dty : src_width - dty - dth;
+            u32 ty = clockwise ? src_height - dtx - dtw : dtx;
+            u32 i, j;
+
+            for(i = 0; i < dtw; i++) {
+                memcpy(tile + i*tile_stride, src + (ty + i)*src_stride + tx*PYNQZ1_BLIT_BPP, dth*PYNQZ1_BLIT_BPP);
+            }
+            for(j = 0; j < dth; j++) {
+                // Each tile column becomes one destination line segment.
+                const u8* s = tile + (clockwise ? j : dth - 1 - j)*PYNQZ1_BLIT_BPP;
+                if( clockwise ) {
+                    for(i = 0; i < dtw; i++) {
+                        pynqz1_blit_pixel(line + i*PYNQZ1_BLIT_BPP, s + (dtw - 1 - i)*tile_stride);
+                    }
+                }
+                else {
+                    for(i = 0; i < dtw; i++) {
+                        pynqz1_blit_pixel(line + i*PYNQZ1_BLIT_BPP, s + i*tile_stride);
+                    }
+                }
+                memcpy(dst + (dty + j)*dst_stride + dtx*PYNQZ1_BLIT_BPP, line, dtw*PYNQZ1_BLIT_BPP);
+            }
+        }
+    }
+}
+
+/**
+ * Write a rectangle of the source surface to the destination frame, rotating it clockwise by rotate degrees.
+ * src_width and src_height are the dimensions of the source surface.
+ * The destination is src_height x src_width for 90 and 270 degrees, src_width x src_height otherwise.
+ * work must be PYNQZ1_BLIT_ROTATE_WORK_SIZE bytes.
+ */
+static inline void pynqz1_blit_rotate(u8* dst, u32 dst_stride, const u8* src, u32 src_stride,
+                                      u32 src_width, u32 src_height, u32 rotate, u8* work,
+                                      u32 x, u32 y, u32 width, u32 height)
+{
+    switch(rotate) {
+    case 90:
+        pynqz1_blit_transpose(dst, dst_stride, src, src_stride, src_width, src_height, 1, work, x, y, width, height);
+        break;
+    case 180:
+        pynqz1_blit_rotate180(dst, dst_stride, src, src_stride, src_width, src_height, work, x, y, width, height);
+        break;
+    case 270:
+        pynqz1_blit_transpose(dst, dst_stride, src, src_stride, src_width, src_height, 0, work, x, y, width, height);
+        break;
+    default:
+        pynqz1_blit_copy(dst, dst_stride, src, src_stride, x, y, width, height);
+        break;
+    }
+}
+
+/**
+ * Write a rectangle of the source surface to the destination frame, magnifying it by an integer factor
+ * with pixel replication. Source pixel (sx, sy) fills the scale x scale block at (sx*scale, sy*scale).
+ * Each source line is expanded once into line (width*scale pixels) on the cached side
+ * and then written to scale destination lines with memcpy.
+ */
+static inline void pynqz1_blit_upscale(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u32 scale, u8* line,
+                                       u32 x, u32 y, u32 width, u32 height)
+{
+    const u32 out_length = width*scale*PYNQZ1_BLIT_BPP;
+    u32 sy;
+
+    for(sy = y; sy < y + height; sy++) {
+        const u8* s = src + sy*src_stride + x*PYNQZ1_BLIT_BPP;
+        u8* d = dst + sy*scale*dst_stride + x*scale*PYNQZ1_BLIT_BPP;
+        u8* l = line;
+        u32 i, r;
+
+        switch(scale) {
+        case 2:
+            for(i = 0; i < width; i++, s += PYNQZ1_BLIT_BPP, l += 2*PYNQZ1_BLIT_BPP) {
+                pynqz1_blit_pixel(l, s);
+                pynqz1_blit_pixel(l + PYNQZ1_BLIT_BPP, s);
+            }
+            break;
+        case 3:
+            for(i = 0; i < width; i++, s += PYNQZ1_BLIT_BPP, l += 3*PYNQZ1_BLIT_BPP) {
+                pynqz1_blit_pixel(l, s);
+                pynqz1_blit_pixel(l + PYNQZ1_BLIT_BPP, s);
+                pynqz1_blit_pixel(l + 2*PYNQZ1_BLIT_BPP, s);
+            }
+            break;
+        default:
+            for(i = 0; i < width; i++, s += PYNQZ1_BLIT_BPP) {
+                for(r = 0; r < scale; r++, l += PYNQZ1_BLIT_BPP) {
+                    pynqz1_blit_pixel(l, s);
+                }
+            }
+            break;
+        }
+        for(r = 0; r < scale; r++, d += dst_stride) {
+            memcpy(d, line, out_length);
+        }
+    }
+}
+
+/**
+ * Write a rectangle of an 8bpp surface to the destination frame, expanding each pixel through lut.
+ * lut holds 256 colors as 0x00RRGGBB. Each line is expanded into line (width pixels) on the cached side
+ * four pixels (three words) at a time, and then written to the destination with a single memcpy.
+ * line must be aligned to 4 bytes.
+ */
+static inline void pynqz1_blit_expand8(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, const u32* lut, u8* line,
+                                       u32 x, u32 y, u32 width, u32 height)
+{
+    const u8* s = src + y*src_stride + x;
+    u8* d = dst + y*dst_stride + x*PYNQZ1_BLIT_BPP;
+    u32 row;
+
+    for(row = 0; row < height; row++, s += src_stride, d += dst_stride) {
+        u32* l = (u32*)line;
+        u32 i = 0;
+
+        for(; i + 4 <= width; i += 4, l += 3) {
+            u32 p0 = lut[s[i]];
+            u32 p1 = lut[s[i + 1]];
+            u32 p2 = lut[s[i + 2]];
+            u32 p3 = lut[s[i + 3]];
+            l[0] = p0         | (p1 << 24);
+            l[1] = (p1 >> 8)  | (p2 << 16);
+            l[2] = (p2 >> 16) | (p3 << 8);
+        }
+        for(; i < width; i++) {
+            u32 p = lut[s[i]];
+            line[i*PYNQZ1_BLIT_BPP + 0] = (u8)p;
+            line[i*PYNQZ1_BLIT_BPP + 1] = (u8)(p >> 8);
+            line[i*PYNQZ1_BLIT_BPP + 2] = (u8)(p >> 16);
+        }
+        memcpy(d, line, width*PYNQZ1_BLIT_BPP);
+    }
+}
+
+/**
+ * Divide a value in [0, 255*255] by 255 with rounding.
+ */
+static inline u32 pynqz1_blit_div255(u32 value)
+{
+    value += 128;
+    return (value + (value >> 8)) >> 8;
+}
+
+/**
+ * Blend a rectangle of A8R8G8B8 pixels over a rectangle of the surface.
+ * dst and src point to the top left pixel of each rectangle.
+ * The per-pixel alpha is multiplied by the global alpha (0-255).
+ * Transparent pixels are skipped and opaque pixels are copied without blending.
+ */
+static inline void pynqz1_blit_blend(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u32 alpha,
+                                     u32 width, u32 height)
+{
+    u32 row;
+
+    for(row = 0; row < height; row++, dst += dst_stride, src += src_stride) {
+        const u32* s = (const u32*)src;
+        u8* d = dst;
+        u32 i;
+
+        for(i = 0; i < width; i++, d += PYNQZ1_BLIT_BPP) {
+            u32 pixel = s[i];
+            u32 a = pynqz1_blit_div255((pixel >> 24)*alpha);
+            u32 na = 255 - a;
+
+            if( a == 0 ) {
+                continue;
+            }
+            if( a == 255 ) {
+                d[0] = (u8)pixel;
+                d[1] = (u8)(pixel >> 8);
+                d[2] = (u8)(pixel >> 16);
+                continue;
+            }
+            d[0] = (u8)pynqz1_blit_div255(( pixel        & 0xffu)*a + d[0]*na);
+            d[1] = (u8)pynqz1_blit_div255(((pixel >> 8)  & 0xffu)*a + d[1]*na);
+            d[2] = (u8)pynqz1_blit_div255(((pixel >> 16) & 0xffu)*a + d[2]*na);
+        }
+    }
+}
+
+// Initial value of pynqz1_blit_hash.
+#define PYNQZ1_BLIT_HASH_INIT 2166136261u
+
+/**
+ * Calculate a hash (32bit FNV-1a over words) of a rectangle whose lines are length bytes long.
+ * Used to detect changes of a region without keeping a copy of it.
+ * Start with PYNQZ1_BLIT_HASH_INIT, or pass the hash of the preceding lines to continue it.
+ */
+static inline u32 pynqz1_blit_hash(u32 hash, const u8* src, u32 src_stride, u32 length, u32 height)
+{
+    u32 row;
+
+    for(row = 0; row < height; row++, src += src_stride) {
+        u32 i = 0;
+        for(; i + 4 <= length; i += 4) {
+            u32 word;
+            memcpy(&word, src + i, 4);
+            hash = (hash ^ word)*16777619u;
+        }
+        for(; i < length; i++) {
+            hash = (hash ^ src[i])*16777619u;
+        }
+    }
+    return hash;
+}
@@ -0,0 +1,130 @@
+/**
+ * @file pynqz1fb_ioctl.h
+ * @author Kenta IDA <fuga@fugafuga.org>
+ * @description
+ * User space interface definition for PYNQ-Z1 frame-buffer driver.
+ * Include this file from applications which use driver specific ioctls.
+ */
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+#ifndef PYNQZ1FB_IOCTL_H
+#define PYNQZ1FB_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/**
+ * Rectangle in the coordinates of the frame buffer device.
+ */
+struct pynqz1_fb_rect {
+    __u32   x;
+    __u32   y;
+    __u32   width;
+    __u32   height;
+};
+
+/**
+ * Placement of an overlay framebuffer device on the primary framebuffer device.
+ */
+struct pynqz1_fb_overlay_config {
+    __s32   x;      // Position of the top left corner.
+    __s32   y;
+    __u32   zorder; // Overlays with larger zorder are drawn above. The primary is always at the bottom.
+    __u32   alpha;  // Global alpha (0-255) which is multiplied with the per-pixel alpha.
+};
+
+/**
+ * Request to read the tiles of the scanout frame changed since they were last read.
+ * The buffer is filled with a sequence of tiles, each of which is a struct pynqz1_fb_tile_header
+ * followed by width*height pixels in the format of the scanout frame (B, G, R bytes) without padding.
+ */
+struct pynqz1_fb_tile_read {
+    __u64   buffer;         // [in]  User space address of the buffer.
+    __u32   size;           // [in]  Size of the buffer in bytes.
+    __u32   flags;          // [in]  PYNQZ1_FB_TILE_READ_XXX flags.
+    __u32   length;         // [out] Number of bytes written to the buffer.
+    __u32   tiles;          // [out] Number of tiles written to the buffer.
+    __u32   remaining;      // [out] Number of changed tiles which did not fit in the buffer. They are returned by the next request.
+    __u32   frame_width;    // [out] Size of the scanout frame in pixels.
+    __u32   frame_height;
+    __u32   tile_size;      // [out] Edge length of tiles in pixels. Tiles on the right and bottom edges may be smaller.
+};
+
+// Return all tiles regardless of changes. Use this to start a new stream.
+#define PYNQZ1_FB_TILE_READ_ALL  (1u << 0)
+
+struct pynqz1_fb_tile_header {
+    __u16   x;      // Position of the tile in the scanout frame in pixels.
+    __u16   y;
+    __u16   width;  // Size of the tile in pixels.
+    __u16   height;
+};
+
+/**
+ * Entry of the presentation queue.
+ * Frame buffer i is mapped at offset i*PAGE_ALIGN(line_length*yres) of the primary framebuffer device.
+ */
+struct pynqz1_fb_present {
+    __u32   buffer;     // [in]  Index of the frame buffer to show.
+    __u32   flags;      // [in]  PYNQZ1_FB_PRESENT_XXX flags.
+    __u64   target;     // [in]  Vertical blanking count at or after which the buffer is shown.
+                        //       With PYNQZ1_FB_PRESENT_TIMESTAMP, CLOCK_MONOTONIC time in nanoseconds. The buffer is shown at the vertical blanking nearest to it.
+    __u64   sequence;   // [out] Sequence number assigned to this entry.
+};
+
+// target is a CLOCK_MONOTONIC time instead of a vertical blanking count.
+#define PYNQZ1_FB_PRESENT_TIMESTAMP (1u << 0)
+
+// Show one entry per vertical blanking in the queued order. Queuing to a full queue fails with EAGAIN.
+#define PYNQZ1_FB_PRESENT_MODE_FIFO     0
+// Show the latest entry whose target has come and skip older ones. Queuing to a full queue drops the oldest entry.
+#define PYNQZ1_FB_PRESENT_MODE_MAILBOX  1
+
+/**
+ * Status of the presentation queue.
+ */
+struct pynqz1_fb_present_status {
+    __u32   mode;           // PYNQZ1_FB_PRESENT_MODE_XXX
+    __u32   queued;         // Number of entries waiting in the queue.
+    __u32   buffer;         // Index of the frame buffer being shown.
+    __u32   reserved;
+    __u64   vblank_count;   // Number of vertical blankings since the driver was loaded.
+    __u64   vblank_time;    // CLOCK_MONOTONIC time of the last vertical blanking in nanoseconds.
+    __u64   last_sequence;  // Sequence number of the entry shown last.
+    __u64   last_vblank;    // Vertical blanking count at which it was shown.
+    __u64   last_time;      // CLOCK_MONOTONIC time in nanoseconds at which it was shown.
+    __u64   presented;      // Number of entries shown.
+    __u64   late;           // Number of entries shown after a vertical blanking nearer to their target.
+    __u64   skipped;        // Number of entries dropped without being shown.
+};
+
+#define PYNQZ1_FB_IOC_MAGIC 'P'
+
+// Notify the driver that the rectangle has been modified through the memory mapping.
+// The driver writes the region to the scanout frame shortly after.
+// Writes are also detected at page granularity without this ioctl, so this is only an optimization.
+// Without the shadow surface, the rectangle is only used by PYNQZ1_FB_IOCTL_READ_TILES.
+#define PYNQZ1_FB_IOCTL_DAMAGE  _IOW(PYNQZ1_FB_IOC_MAGIC, 0, struct pynqz1_fb_rect)
+
+// Get or set the placement of an overlay. Valid only for overlay framebuffer devices.
+#define PYNQZ1_FB_IOCTL_GET_OVERLAY _IOR(PYNQZ1_FB_IOC_MAGIC, 1, struct pynqz1_fb_overlay_config)
+#define PYNQZ1_FB_IOCTL_SET_OVERLAY _IOW(PYNQZ1_FB_IOC_MAGIC, 2, struct pynqz1_fb_overlay_config)
+
+// Read the changed tiles of the scanout frame. Valid only for the primary framebuffer device.
+#define PYNQZ1_FB_IOCTL_READ_TILES  _IOWR(PYNQZ1_FB_IOC_MAGIC, 3, struct pynqz1_fb_tile_read)
+
+// Queue a frame buffer to be shown. Requires the VTC interrupt, and is not available with the shadow surface.
+#define PYNQZ1_FB_IOCTL_PRESENT             _IOWR(PYNQZ1_FB_IOC_MAGIC, 4, struct pynqz1_fb_present)
+#define PYNQZ1_FB_IOCTL_GET_PRESENT_STATUS  _IOR(PYNQZ1_FB_IOC_MAGIC, 5, struct pynqz1_fb_present_status)
+// Set the presentation mode. The argument is a pointer to a __u32 PYNQZ1_FB_PRESENT_MODE_XXX value.
+#define PYNQZ1_FB_IOCTL_SET_PRESENT_MODE    _IOW(PYNQZ1_FB_IOC_MAGIC, 6, __u32)
+
+#endif // PYNQZ1FB_IOCTL_H